@@ -0,0 +1,109 @@
+#pragma once
+
+#include <time.h>
+#include "softusb_sim.h"
+
+// Free-running timer 1.5 MHz
+#define TIMER_1500_KHZ_VALUE		softusb_sim_timer()
+
+// Restart and synchronize 1.5 us timer
+#define TIMER_1500_KHZ_SYNC			softusb_sim_timer_sync()
+
+#define SOFTUSB_ENABLE_IRQ
+#define SOFTUSB_DISABLE_IRQ
+
+#define SOFTUSB_MEMORY_BARRIER		__sync_synchronize()
+
+// Number of trailing zero bits of a nonzero word
+#define SOFTUSB_CTZ(v)				__builtin_ctz(v)
+
+// Nanoseconds instead of CPU cycles for SOFTUSB_STATS
+static inline unsigned int softusb_host_cycles()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (unsigned int)(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+#define SOFTUSB_CYCLES				softusb_host_cycles()
+
+#define SOFTUSB_CYCLES_INIT
+
+// Fast set/reset of + and - pins
+#define SOFTUSB_M				_bus->write(_m)
+#define SOFTUSB_P				_bus->write(_p)
+#define SOFTUSB_Z				_bus->write(_z)
+#define SOFTUSB_OUT(v)			_bus->write(v)
+
+// Toggle input/output
+#define SOFTUSB_INPUT			_bus->set_output(0)
+#define SOFTUSB_OUTPUT			_bus->set_output(1)
+
+// Read macro
+#define SOFTUSB_READ(v)	\
+		v = _bus->read()
+
+// Sync to 1.5 us macro
+#define SOFTUSB_WAIT	\
+		t = TIMER_1500_KHZ_VALUE;	\
+		while (t == TIMER_1500_KHZ_VALUE)
+
+// Save 1.5 us timer value
+#define SOFTUSB_BEGIN_INTERVAL	\
+		t = TIMER_1500_KHZ_VALUE
+
+// Sync to a next timer's tick
+#define SOFTUSB_WAIT_TICK	\
+		while (t == TIMER_1500_KHZ_VALUE)
+
+// Simulated DMA transmitter, see platform_stm32f4.h
+#ifdef SOFTUSB_DMA_TX
+
+#define SOFTUSB_DMA_TX_START(wave, count)	\
+		_bus->dma_tx_start(wave, count)
+
+#define SOFTUSB_DMA_TX_BUSY		\
+		(_bus->dma_tx_left() != 0)
+
+#endif
+
+// Simulated sampled receiver, see platform_stm32f4.h
+#ifdef SOFTUSB_DMA_RX
+
+#define SOFTUSB_DMA_RX_PERIOD	(3 * 256)
+
+#define SOFTUSB_DMA_RX_SAMPLES	448
+
+#define SOFTUSB_DMA_RX_START(buffer, count)	\
+		_bus->dma_rx_start(buffer, count, SOFTUSB_DMA_RX_PERIOD)
+
+#define SOFTUSB_DMA_RX_LEFT		\
+		(_bus->dma_rx_left())
+
+#define SOFTUSB_DMA_RX_STOP		\
+		_bus->dma_rx_stop()
+
+#endif
+
+// Platform constructor part
+#define SOFTUSB_PLATFORM_CTOR	\
+		_bus = softusb_sim_bus(_port);	\
+		_bus->attach_host(_mpin, _ppin);	\
+		_m = (1 << _mpin) | (0x10000u << _ppin);	\
+		_p = (1 << _ppin) | (0x10000u << _mpin);	\
+		_z = (0x10000u << _mpin) | (0x10000u << _ppin)
+
+// Platform private fields
+#define SOFTUSB_PLATFORM_PRIVATE\
+	SoftUsbSimBus *_bus;	\
+	unsigned int _m;	\
+	unsigned int _p;	\
+	unsigned int _z
+
+// Constant fields of SoftUsbT, the bus is found at runtime
+#define SOFTUSB_PLATFORM_CONST(port, mpin, ppin)	\
+	static constexpr unsigned int _m = (1u << (mpin)) | (0x10000u << (ppin));	\
+	static constexpr unsigned int _p = (1u << (ppin)) | (0x10000u << (mpin));	\
+	static constexpr unsigned int _z = (0x10000u << (mpin)) | (0x10000u << (ppin))
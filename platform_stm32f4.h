@@ -11,24 +11,35 @@
 #define SOFTUSB_ENABLE_IRQ			NVIC_EnableIRQ(TIM2_IRQn)
 #define SOFTUSB_DISABLE_IRQ			NVIC_DisableIRQ(TIM2_IRQn)
 
+// Order ring buffer data and index stores
+#define SOFTUSB_MEMORY_BARRIER		__DMB()
+
+// Number of trailing zero bits of a nonzero word
+#define SOFTUSB_CTZ(v)				__CLZ(__RBIT(v))
+
+// CPU cycle counter for SOFTUSB_STATS
+#define SOFTUSB_CYCLES				DWT->CYCCNT
+
+#define SOFTUSB_CYCLES_INIT	\
+		CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;	\
+		DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk
+
 // Fast set/reset of + and - pins
-#define SOFTUSB_M				*_bssr = _m
-#define SOFTUSB_P				*_bssr = _p
-#define SOFTUSB_Z				*_bssr = _z
-#define SOFTUSB_OUT(v)			*_bssr = v
+#define SOFTUSB_M				*bsrr() = _m
+#define SOFTUSB_P				*bsrr() = _p
+#define SOFTUSB_Z				*bsrr() = _z
+#define SOFTUSB_OUT(v)			*bsrr() = v
 
-// Toggle input/output
+// Toggle input/output of both pins with one write
 #define SOFTUSB_INPUT	\
-	_gpio->MODER = (_gpio->MODER & (~(3ul << (_mpin * 2)))) | (0 << (_mpin * 2));	\
-	_gpio->MODER = (_gpio->MODER & (~(3ul << (_ppin * 2)))) | (0 << (_ppin * 2))
+	gpio()->MODER = gpio()->MODER & _moder_mask
 
 #define SOFTUSB_OUTPUT	\
-	_gpio->MODER = (_gpio->MODER & (~(3ul << (_mpin * 2)))) | (1 << (_mpin * 2));	\
-	_gpio->MODER = (_gpio->MODER & (~(3ul << (_ppin * 2)))) | (1 << (_ppin * 2))
+	gpio()->MODER = (gpio()->MODER & _moder_mask) | _moder_out
 
 // Read macro
 #define SOFTUSB_READ(v)	\
-		v = _gpio->IDR
+		v = gpio()->IDR
 		
 // Sync to 1.5 us macro
 #define SOFTUSB_WAIT	\
@@ -43,12 +54,73 @@
 #define SOFTUSB_WAIT_TICK	\
 		while (t == TIMER_1500_KHZ_VALUE)
 
+// Optional DMA transmitter: define SOFTUSB_DMA_TX to send packets with
+// DMA2 Stream5 Channel 6 requested by TIM1 update event.
+// TIM1 must be configured to overflow at 1.5 MHz and DMA2 clock enabled.
+// Output words are kept in the SoftUsb object, which should be placed in
+// SRAM1/SRAM2: DMA can't access CCM RAM of STM32F405/407/429.
+// CPU waits for the end of the packet, interrupts may run meanwhile.
+#ifdef SOFTUSB_DMA_TX
+
+// Start output of prepared BSRR words
+#define SOFTUSB_DMA_TX_START(wave, count)	\
+		DMA2_Stream5->CR = 0;	\
+		DMA2->HIFCR = 0x0F40;	\
+		DMA2_Stream5->PAR = (unsigned long)bsrr();	\
+		DMA2_Stream5->M0AR = (unsigned long)(wave);	\
+		DMA2_Stream5->NDTR = (count);	\
+		DMA2_Stream5->CR = (6ul << 25) | DMA_SxCR_PL_1 | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 | DMA_SxCR_MINC | DMA_SxCR_DIR_0;	\
+		TIM1->DIER |= TIM_DIER_UDE;	\
+		DMA2_Stream5->CR |= DMA_SxCR_EN
+
+// Not all words are sent yet
+#define SOFTUSB_DMA_TX_BUSY		\
+		(DMA2_Stream5->NDTR != 0)
+
+#endif
+
+// Optional sampled receiver: define SOFTUSB_DMA_RX to capture the input
+// register with DMA2 Stream1 Channel 7 requested by TIM8 update event and
+// decode packets after EOP. TIM8 must be configured to overflow at 4.5 MHz
+// (3 samples per bit) and DMA2 clock enabled. Samples are kept in the SoftUsb
+// object, which should be placed in SRAM1/SRAM2 like for SOFTUSB_DMA_TX.
+#ifdef SOFTUSB_DMA_RX
+
+// Samples per bit, 1/256 units. 1.5 samples per bit (384) also works,
+// but only with devices that have an accurate clock
+#define SOFTUSB_DMA_RX_PERIOD	(3 * 256)
+
+// Capture buffer size, enough for the longest packet and response delay
+#define SOFTUSB_DMA_RX_SAMPLES	448
+
+// Start capture of input register
+#define SOFTUSB_DMA_RX_START(buffer, count)	\
+		DMA2_Stream1->CR = 0;	\
+		DMA2->LIFCR = 0x0F40;	\
+		DMA2_Stream1->PAR = (unsigned long)&gpio()->IDR;	\
+		DMA2_Stream1->M0AR = (unsigned long)(buffer);	\
+		DMA2_Stream1->NDTR = (count);	\
+		DMA2_Stream1->CR = (7ul << 25) | DMA_SxCR_PL_1 | DMA_SxCR_MSIZE_0 | DMA_SxCR_PSIZE_0 | DMA_SxCR_MINC;	\
+		TIM8->DIER |= TIM_DIER_UDE;	\
+		DMA2_Stream1->CR |= DMA_SxCR_EN
+
+// Samples not captured yet
+#define SOFTUSB_DMA_RX_LEFT		\
+		(DMA2_Stream1->NDTR)
+
+#define SOFTUSB_DMA_RX_STOP		\
+		DMA2_Stream1->CR &= ~DMA_SxCR_EN
+
+#endif
+
 // Platform constructor part
 #define SOFTUSB_PLATFORM_CTOR	\
 		_gpio = (GPIO_TypeDef *)(((unsigned long)GPIOA) + _port * (((unsigned long)GPIOB) - ((unsigned long)GPIOA)));	\
 		_m = (1 << _mpin) | (0x10000u << _ppin);	\
 		_p = (1 << _ppin) | (0x10000u << _mpin);	\
 		_z = (0x10000u << _mpin) | (0x10000u << _ppin);	\
+		_moder_mask = ~((3u << (_mpin * 2)) | (3u << (_ppin * 2)));	\
+		_moder_out = (1u << (_mpin * 2)) | (1u << (_ppin * 2));	\
 		_bssr = (volatile unsigned int *)&_gpio->BSRRL
 
 // Platform private fields
@@ -57,4 +129,18 @@
 	unsigned int _m;	\
 	unsigned int _p;	\
 	unsigned int _z;	\
-	volatile unsigned int *_bssr
+	unsigned int _moder_mask;	\
+	unsigned int _moder_out;	\
+	volatile unsigned int *_bssr;	\
+	GPIO_TypeDef *gpio() { return _gpio; }	\
+	volatile unsigned int *bsrr() { return _bssr; }
+
+// Constant fields and registers of SoftUsbT
+#define SOFTUSB_PLATFORM_CONST(port, mpin, ppin)	\
+	static constexpr unsigned int _m = (1u << (mpin)) | (0x10000u << (ppin));	\
+	static constexpr unsigned int _p = (1u << (ppin)) | (0x10000u << (mpin));	\
+	static constexpr unsigned int _z = (0x10000u << (mpin)) | (0x10000u << (ppin));	\
+	static constexpr unsigned int _moder_mask = ~((3u << ((mpin) * 2)) | (3u << ((ppin) * 2)));	\
+	static constexpr unsigned int _moder_out = (1u << ((mpin) * 2)) | (1u << ((ppin) * 2));	\
+	static GPIO_TypeDef *gpio() { return (GPIO_TypeDef *)(GPIOA_BASE + (port) * (GPIOB_BASE - GPIOA_BASE)); }	\
+	static volatile unsigned int *bsrr() { return (volatile unsigned int *)&gpio()->BSRRL; }
@@ -5,9 +5,12 @@
 // Consts
 /////////////////////////////////////////////////////////////////////////
 
+#define SOFTUSB_RETRIES			50
 #define DEBOUNCE_MS				500
 #define RESET_MS				20
-#define SOFTUSB_RETRIES			50
+// Address assigned to the device. Hubs are full-speed devices, so there is
+// only one device on a port
+#define SOFTUSB_DEVICE_ADDRESS	1
 #define SOFTUSB_PACKET_PAUSE_MS	10
 #define SOFTUSB_BUFFER_SIZE		20
 
@@ -27,11 +30,17 @@
 #define TRANS_IN				0x69
 #define TRANS_SETUP				0x2D
 
+// Remainder of USB CRC16 over data followed by its CRC
+#define CRC16_RESIDUAL			0xB001
+
+// One nibble of CRC16 in reflected form
+#define CRC16_NIBBLE(crc)		crc = (crc >> 4) ^ SoftUsb::_crc16_table[crc & 0x0F]
+
 
 
 
-#if (HID_MAX_PRESSED_KEYS < 1 || HID_MAX_PRESSED_KEYS > 4)
-	#error "HID_MAX_PRESSED_KEYS must be in range 1..4"
+#ifndef SOFTUSB_CTZ
+	#error "SOFTUSB_CTZ must be defined by the platform file"
 #endif
 
 /////////////////////////////////////////////////////////////////////////
@@ -67,48 +76,102 @@ const unsigned char ascii_upper[] =
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '-', '+', 0, 0, 0, 0
 };
 
-KeyboardBuffer::KeyboardBuffer()
+const unsigned short SoftUsb::_crc16_table[16] =
+{
+	0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+	0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+};
+
+// CRC5 (poly 0x05, reflected) of 4 and 3 bits
+static const unsigned char crc5_table[16] =
+{
+	0x00, 0x16, 0x05, 0x13, 0x0A, 0x1C, 0x0F, 0x19, 0x14, 0x02, 0x11, 0x07, 0x1E, 0x08, 0x1B, 0x0D
+};
+
+static const unsigned char crc5_table3[8] =
+{
+	0x00, 0x05, 0x0A, 0x0F, 0x14, 0x11, 0x1E, 0x1B
+};
+
+/////////////////////////////////////////////////////////////////////////
+// Precomputed packets
+/////////////////////////////////////////////////////////////////////////
+
+// Compile-time CRC5 and CRC16, bit by bit
+constexpr unsigned int crc5_bits(unsigned int crc, unsigned int data, int n)
 {
-	_rp = 0;
-	_wp = 0;
-	_n = 0;
+	return n == 0 ? crc :
+		crc5_bits(((data ^ crc) & 1) ? (crc >> 1) ^ 0x14 : crc >> 1, data >> 1, n - 1);
 }
 
-void KeyboardBuffer::add(unsigned char code)
+constexpr unsigned int token_value(unsigned int addr, unsigned int ep)
 {
-	// Check for buffer overflow
-	if (_n >= sizeof(_buffer) / sizeof(_buffer[0]))
-	{
-		_rp %= KEYBOARD_BUFFER_SIZE;
-		_n--;
-	}
-	
-	_buffer[_wp++] = code;
-	_wp %= KEYBOARD_BUFFER_SIZE;
-	_n++;
+	return addr + ep * 128 + ((crc5_bits(0x1F, addr + ep * 128, 11) ^ 0x1F) << 11);
 }
 
-int KeyboardBuffer::get()
+constexpr unsigned int crc16_bits(unsigned int crc, int n)
 {
-	int res;
-	
-	if (_n <= 0)
-	{
-		return 0;
-	}
-	
-	res = _buffer[_rp++];
-	_rp %= KEYBOARD_BUFFER_SIZE;
-	_n--;
-	
-	return res;
+	return n == 0 ? crc : crc16_bits((crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1, n - 1);
 }
 
-int KeyboardBuffer::is_empty()
+constexpr unsigned int crc16_request(unsigned int crc, const unsigned char *data, int count)
 {
-	return _n == 0;
+	return count == 0 ? crc ^ 0xFFFFu : crc16_request(crc16_bits(crc ^ *data, 8), data + 1, count - 1);
 }
 
+// SYNC, PID and token data
+#define TOKEN_PACKET(pid, addr, ep)	\
+	{ 0x80, pid, token_value(addr, ep) & 0xFF, token_value(addr, ep) >> 8 }
+
+#define TOKEN_INDEX(pid)		((pid) == TOKEN_IN ? 1 : (pid) == TOKEN_SETUP ? 2 : 0)
+
+// Tokens for address 0 and device address, endpoints 0 and 1
+static const unsigned char token_packets[3][2][2][4] =
+{
+	{
+		{ TOKEN_PACKET(TOKEN_OUT, 0, 0), TOKEN_PACKET(TOKEN_OUT, 0, 1) },
+		{ TOKEN_PACKET(TOKEN_OUT, SOFTUSB_DEVICE_ADDRESS, 0), TOKEN_PACKET(TOKEN_OUT, SOFTUSB_DEVICE_ADDRESS, 1) }
+	},
+	{
+		{ TOKEN_PACKET(TOKEN_IN, 0, 0), TOKEN_PACKET(TOKEN_IN, 0, 1) },
+		{ TOKEN_PACKET(TOKEN_IN, SOFTUSB_DEVICE_ADDRESS, 0), TOKEN_PACKET(TOKEN_IN, SOFTUSB_DEVICE_ADDRESS, 1) }
+	},
+	{
+		{ TOKEN_PACKET(TOKEN_SETUP, 0, 0), TOKEN_PACKET(TOKEN_SETUP, 0, 1) },
+		{ TOKEN_PACKET(TOKEN_SETUP, SOFTUSB_DEVICE_ADDRESS, 0), TOKEN_PACKET(TOKEN_SETUP, SOFTUSB_DEVICE_ADDRESS, 1) }
+	}
+};
+
+// Standard requests
+constexpr unsigned char get_device_descriptor_request[8] = {0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00};
+constexpr unsigned char set_address_request[8] = {0x00, 0x05, SOFTUSB_DEVICE_ADDRESS, 0x00, 0x00, 0x00, 0x00, 0x00};
+constexpr unsigned char set_configuration_request[8] = {0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00};
+constexpr unsigned char get_conf_descriptor_request[8] = {0x80, 0x06, 0x00, 0x02, 0x00, 0x00, SOFTUSB_CONF_DESCR_SIZE, 0x00};
+
+// Interface and length are filled at runtime
+constexpr unsigned char get_report_descriptor_request[8] = {0x81, 0x06, 0x00, 0x22, 0x00, 0x00, 0x00, 0x00};
+
+// HID class requests, value and interface are filled at runtime
+constexpr unsigned char set_protocol_request[8] = {0x21, 0x0B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+constexpr unsigned char set_idle_request[8] = {0x21, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+// Output report, report ID, interface and length are filled at runtime
+constexpr unsigned char set_report_request[8] = {0x21, 0x09, 0x00, 0x02, 0x00, 0x00, 0x01, 0x00};
+
+// SYNC, DATA0 and request with its CRC16
+#define REQUEST_PACKET(r)	\
+	{ 0x80, DATA_DATA0, r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7],	\
+	  crc16_request(0xFFFFu, r, 8) & 0xFF, crc16_request(0xFFFFu, r, 8) >> 8 }
+
+static const unsigned char get_device_descriptor_packet[12] = REQUEST_PACKET(get_device_descriptor_request);
+static const unsigned char set_address_packet[12] = REQUEST_PACKET(set_address_request);
+static const unsigned char set_configuration_packet[12] = REQUEST_PACKET(set_configuration_request);
+static const unsigned char get_conf_descriptor_packet[12] = REQUEST_PACKET(get_conf_descriptor_request);
+
+// Handshakes
+static const unsigned char ack_packet[2] = {0x80, HANDSHAKE_ACK};
+static const unsigned char nak_packet[2] = {0x80, HANDSHAKE_NAK};
+
 SoftUsb::SoftUsb(unsigned int port, unsigned int mpin, unsigned int ppin)
 {
 	int i;
@@ -125,98 +188,373 @@ SoftUsb::SoftUsb(unsigned int port, unsigned int mpin, unsigned int ppin)
 	_retries = 0;
 	_data_0 = 1;
 	_descr_offset = 0;
+	_rx_crc = 0;
+	_rx_pid = 0;
+	_frame = 0;
+	_poll_interval = 0;
+	_fast_enum = 0;
+	_idle_naks = SOFTUSB_IDLE_NAKS;
+	_idle_max_interval = SOFTUSB_IDLE_MAX_INTERVAL;
+	reset_poll_stats();
+	_cache = 0;
+	_cache_store = 0;
+	_control_budget = 0;
+	_frame_ticks = 0;
+	_status_addr = 0;
+	_status_next = su_nodevice;
+	_hid_protocol = SOFTUSB_PROTOCOL_AUTO;
+	_idle_rate = SOFTUSB_DEFAULT_IDLE_RATE;
+	_hid_intf = 0;
+	_hid_step = 0;
+	_conf_length = 0;
+	_parse_pos = 0;
+	_parse_length = 0;
+	_parse_intf = -1;
+	_interface_count = 0;
+	_endpoint_count = 0;
+	_report_intf = 0;
+	_field_count = 0;
 	
 	_keyb_control = 0;
-	_mouse_x = 0;
-	_mouse_y = 0;
-	_mouse_b = 0;
-	_mouse_wheel = 0;
-	
-	for (i = 0; i < sizeof(_keys_pressed); i++)
+	_keyb_locks = 0;
+	_leds_sent = 0;
+	_leds_value = 0;
+	_led_intf = -1;
+	_raw_reports = 0;
+	_raw_index = 0;
+	_raw_reading = 0;
+	_raw_seq = 0;
+	
+	for (i = 0; i < 2; i++)
 	{
-		_keys_pressed[i] = 0;
+		_raw[i].length = 0;
+		_raw[i].intf = 0;
+		_raw[i].ep = 0;
+		_raw[i].seq = 0;
 	}
 	
-	for (i = 0; i < sizeof(_keys_pressed_prev); i++)
+	_mouse.x = 0;
+	_mouse.y = 0;
+	_mouse.buttons = 0;
+	_mouse.wheel = 0;
+	_mouse.dx = 0;
+	_mouse.dy = 0;
+	_mouse.dwheel = 0;
+	_mouse_seq = 0;
+	_mouse_consumed_dx = 0;
+	_mouse_consumed_dy = 0;
+	_mouse_consumed_dwheel = 0;
+	
+	for (i = 0; i < HID_KEY_WORDS; i++)
 	{
-		_keys_pressed_prev[i] = 0;
+		_keys[i] = 0;
 	}
 	
 	SOFTUSB_PLATFORM_CTOR;
+	
+#ifdef SOFTUSB_STATS
+	SOFTUSB_CYCLES_INIT;
+	
+	reset_stats();
+#endif
+
+#ifdef SOFTUSB_TRACE
+	_trace_head = 0;
+	_trace_tail = 0;
+	_trace_id = 0;
+	_trace_start = 0;
+	_trace_ticks = 0;
+#endif
 }
 
 void SoftUsb::timer1ms(int allow_long_work)
 {
+#ifdef SOFTUSB_STATS
+	SoftUsbState state = _state;
+	unsigned int start = SOFTUSB_CYCLES;
+	unsigned int cycles;
+	softusb_state_stats_t *st;
+	int work, i;
+	
+	work = frame(allow_long_work);
+	
+	cycles = SOFTUSB_CYCLES - start;
+	
+	switch (work)
+	{
+		case SOFTUSB_TICK_IDLE:
+			_stats.idle_ticks++;
+			break;
+		case SOFTUSB_TICK_KEEPALIVE:
+			_stats.keepalive_ticks++;
+			break;
+		default:
+			_stats.transaction_ticks++;
+			break;
+	}
+	
+	st = &_stats.states[state];
+	
+	if (st->calls == 0 || cycles < st->min)
+	{
+		st->min = cycles;
+	}
+	
+	if (cycles > st->max)
+	{
+		st->max = cycles;
+	}
+	
+	st->calls++;
+	st->total += cycles;
+	
+	for (i = 0; i < SOFTUSB_STATS_BUCKETS - 1 && (cycles >> (i + 1)) != 0; i++)
+	{
+	}
+	
+	st->histogram[i]++;
+#else
+	frame(allow_long_work);
+#endif
+}
+
+// One 1 ms step of the state machine, returns SOFTUSB_TICK_*
+int SoftUsb::frame(int allow_long_work)
+{
+	unsigned int spent = 0;
+	
+	_frame++;
+	_frame_ticks = 0;
+	
 	if (_timer > 0)
 	{
 		_timer--;
-		return;
+		return SOFTUSB_TICK_IDLE;
 	}
 	
 	switch (_state)
 	{
 		case su_nodevice:
 			process_nodevice();
-			return;
+			return SOFTUSB_TICK_IDLE;
 		case su_fullspeed:
 			process_fullspeed();
-			return;
+			return SOFTUSB_TICK_IDLE;
 		case su_debounce:
 			process_debounce();
-			return;
+			return SOFTUSB_TICK_IDLE;
 		case su_reset:
 			process_reset();
-			return;
+			return SOFTUSB_TICK_IDLE;
 		default:
 			break;
 	}
 	
-	keepalive();
+	// Device is gone if the line is not idle
+	if (!keepalive())
+	{
+		set_state(su_nodevice);
+		_timer = _fast_enum ? SOFTUSB_FAST_DEBOUNCE_MS : DEBOUNCE_MS;
+	}
+	
+	if (!allow_long_work)
+	{
+		if (_state_timer > 0)
+		{
+			_state_timer--;
+		}
+		
+		return SOFTUSB_TICK_KEEPALIVE;
+	}
 	
 	if (_state_timer > 0)
 	{
 		_state_timer--;
-		return;
+		
+		// Frames between polls send output reports
+		if (!has_output_report())
+		{
+			return SOFTUSB_TICK_KEEPALIVE;
+		}
+		
+		set_state(su_set_report);
 	}
 	
-	if (!allow_long_work)
+	do
 	{
-		return;
+		spent += SOFTUSB_TRANSACTION_TICKS;
+		
+		switch (_state)
+		{
+			case su_connected:
+				process_connected();
+				break;
+			case su_read_descr:
+				process_read_descr();
+				break;
+			case su_query_conf_descr:
+				process_query_conf_descr();
+				break;
+			case su_read_conf_descr:
+				process_read_conf_descr();
+				break;
+			case su_set_address:
+				process_set_address();
+				break;
+			case su_wait_address:
+				process_wait_address();
+				break;
+			case su_set_conf:
+				process_set_conf();
+				break;
+			case su_wait_conf:
+				process_wait_conf();
+				break;
+			case su_query_report_descr:
+				process_query_report_descr();
+				break;
+			case su_read_report_descr:
+				process_read_report_descr();
+				break;
+			case su_control_status:
+				process_control_status();
+				break;
+			case su_set_hid:
+				process_set_hid();
+				break;
+			case su_wait_hid:
+				process_wait_hid();
+				break;
+			case su_set_report:
+				process_set_report();
+				break;
+			case su_report_data:
+				process_report_data();
+				break;
+			case su_report_status:
+				process_report_status();
+				break;
+			case su_work:
+				process_work();
+				break;
+			default:
+				break;
+		}
+		
+		// Endpoints polled every frame leave no frames between polls,
+		// the output report follows the poll if the frame has time for it
+		if (_state == su_work && _state_timer == 0 && has_output_report() && !has_due_endpoint() &&
+			has_control_time(spent))
+		{
+			set_state(su_set_report);
+		}
 	}
+	// Data and status stages of a control transfer follow in the same frame
+	while (_state_timer == 0 && (is_control_stage() || _state == su_set_report) && has_control_time(spent));
 	
+	_frame_ticks = spent;
+	
+	return SOFTUSB_TICK_TRANSACTION;
+}
+
+// Stage of a control transfer started by SETUP
+int SoftUsb::is_control_stage()
+{
 	switch (_state)
 	{
-		case su_connected:
-			process_connected();
-			break;
 		case su_read_descr:
-			process_read_descr();
-			break;
-		case su_query_conf_descr:
-			process_query_conf_descr();
-			break;
-		case su_read_conf_descr:
-			process_read_conf_descr();
-			break;
-		case su_set_address:
-			process_set_address();
-			break;
 		case su_wait_address:
-			process_wait_address();
-			break;
-		case su_set_conf:
-			process_set_conf();
-			break;
 		case su_wait_conf:
-			process_wait_conf();
-			break;
+		case su_read_conf_descr:
+		case su_read_report_descr:
+		case su_control_status:
+		case su_wait_hid:
+		case su_report_data:
+		case su_report_status:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Enumerated device, polled or sending an output report
+int SoftUsb::is_work_state()
+{
+	switch (_state)
+	{
+		case su_set_report:
+		case su_report_data:
+		case su_report_status:
 		case su_work:
-			process_work();
-			break;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// One more transaction fits the control budget or the frame,
+// time is estimated as SoftUsbHost does (the 1.5 MHz timer is restarted by receive)
+int SoftUsb::has_control_time(unsigned int spent)
+{
+	unsigned int budget = _control_budget;
+	
+	if (budget == 0)
+	{
+		budget = SOFTUSB_CONTROL_FRAME_TICKS;
+	}
+	
+	return spent + SOFTUSB_TRANSACTION_TICKS <= budget;
+}
+
+int SoftUsb::has_pending_work()
+{
+	if (_timer > 0)
+	{
+		return 0;
+	}
+	
+	switch (_state)
+	{
+		case su_nodevice:
+		case su_fullspeed:
+		case su_debounce:
+		case su_reset:
+			return 0;
 		default:
 			break;
 	}
+	
+	return _state_timer == 0 || has_output_report();
+}
+
+#ifdef SOFTUSB_STATS
+const softusb_stats_t *SoftUsb::get_stats()
+{
+	return &_stats;
+}
+
+void SoftUsb::reset_stats()
+{
+	int i, j;
+	
+	for (i = 0; i < SOFTUSB_STATES; i++)
+	{
+		_stats.states[i].calls = 0;
+		_stats.states[i].min = 0;
+		_stats.states[i].max = 0;
+		_stats.states[i].total = 0;
+		
+		for (j = 0; j < SOFTUSB_STATS_BUCKETS; j++)
+		{
+			_stats.states[i].histogram[j] = 0;
+		}
+	}
+	
+	_stats.idle_ticks = 0;
+	_stats.keepalive_ticks = 0;
+	_stats.transaction_ticks = 0;
 }
+#endif
 
 SoftUsbState SoftUsb::get_state()
 {
@@ -225,7 +563,7 @@ SoftUsbState SoftUsb::get_state()
 
 int SoftUsb::is_connected()
 {
-	return _state == su_work;
+	return is_work_state();
 }
 
 int SoftUsb::get_device_type()
@@ -240,228 +578,391 @@ int SoftUsb::get_device_type()
 		return USB_DEVICE_NOT_CONNECTED;
 	}
 	
-	const usb_interface_descriptor_t *intf = get_interface_descriptor();
+	int i, type = 0;
 	
-	if (intf->interface_subclass == 1)
+	for (i = 0; i < _interface_count; i++)
 	{
-		switch (get_interface_descriptor()->protocol)
+		if (_interfaces[i].type != USB_DEVICE_UNKNOWN)
 		{
-			case 1:
-				return USB_DEVICE_KEYBOARD;
-			case 2:
-				return USB_DEVICE_MOUSE;
+			type |= _interfaces[i].type;
 		}
 	}
 	
-	return USB_DEVICE_UNKNOWN;
+	// Keyboard and mouse interfaces tell what the device is
+	if (type & USB_DEVICE_COMPOSITE)
+	{
+		return type & USB_DEVICE_COMPOSITE;
+	}
+	
+	return type != 0 ? type : USB_DEVICE_UNKNOWN;
 }
 
-const usb_device_descriptor_t *SoftUsb::get_device_descriptor()
+int SoftUsb::get_interface_type(int index)
 {
-	return (usb_device_descriptor_t *)_descriptor;
+	if (index < 0 || index >= _interface_count)
+	{
+		return USB_DEVICE_NOT_CONNECTED;
+	}
+	
+	return _interfaces[index].type;
 }
 
-const usb_configuration_descriptor_t *SoftUsb::get_conf_descriptor()
+int SoftUsb::get_interface_count()
 {
-	return (usb_configuration_descriptor_t *)_conf_descriptor;
+	return _interface_count;
 }
 
-const usb_interface_descriptor_t *SoftUsb::get_interface_descriptor()
+int SoftUsb::get_endpoint_count()
 {
-	return (usb_interface_descriptor_t *)&_conf_descriptor[9];
+	return _endpoint_count;
 }
 
-const unsigned char *SoftUsb::get_device_report()
+const softusb_field_t *SoftUsb::get_report_field(int index)
 {
-	return _report;
+	if (index < 0 || index >= _field_count)
+	{
+		return 0;
+	}
+	
+	return &_fields[index];
 }
 
-unsigned short SoftUsb::get_vendor_id()
+int SoftUsb::get_report_field_count()
 {
-	return _vendor_id;
+	return _field_count;
 }
 
-unsigned short SoftUsb::get_device_id()
+const usb_device_descriptor_t *SoftUsb::get_device_descriptor()
 {
-	return _vendor_id;
+	return (usb_device_descriptor_t *)_descriptor;
 }
 
-int SoftUsb::getch()
+const usb_configuration_descriptor_t *SoftUsb::get_conf_descriptor()
 {
-	int res;
-	
-	SOFTUSB_DISABLE_IRQ;
-	
-	res = _keyb_chars_buffer.get();
-	
-	SOFTUSB_ENABLE_IRQ;
-	
-	return res;
+	return (usb_configuration_descriptor_t *)_conf_descriptor;
 }
 
-int SoftUsb::kbhit()
+const usb_interface_descriptor_t *SoftUsb::get_interface_descriptor(int index)
 {
-	return !_keyb_chars_buffer.is_empty();
+	if (index < 0 || index >= _interface_count)
+	{
+		return 0;
+	}
+	
+	return &_interfaces[index].descr;
 }
 
-int SoftUsb::get_key_code()
+const usb_endpoint_descriptor_t *SoftUsb::get_endpoint_descriptor(int index)
 {
-	int res;
-	
-	SOFTUSB_DISABLE_IRQ;
-	
-	res = _keyb_buffer.get();
-	
-	SOFTUSB_ENABLE_IRQ;
+	if (index < 0 || index >= _endpoint_count)
+	{
+		return 0;
+	}
 	
-	return res;
+	return &_endpoints[index].descr;
 }
 
-void SoftUsb::get_mouse_pos(int &x, int &y, int &buttons, int &wheel)
+void SoftUsb::set_poll_interval(int interval)
 {
-	x = _mouse_x;
-	y = _mouse_y;
-	buttons = _mouse_b;
-	wheel = _mouse_wheel;
+	_poll_interval = interval;
 }
 
-void SoftUsb::add_key(int code)
+int SoftUsb::get_poll_interval()
 {
-	_keyb_buffer.add(code);
-	
-	if (code & 0x80)
-	{
-		return;
-	}
-	
-	if (_keyb_control & KEYBOARD_CONTROL_SHIFT)
-	{
-		code = ascii_upper[code];
-	}
-	else
-	{
-		code = ascii_lower[code];
-	}
-	
-	if (code == 0)
-	{
-		return;
-	}
-	
-	_keyb_chars_buffer.add(code);
+	return get_endpoint_interval(0);
 }
 
-void SoftUsb::set_state(SoftUsbState newstate)
+void SoftUsb::set_idle_backoff(int naks, int max_interval)
 {
-	_timer = 0;
-	_state_timer = 0;
-	_retries = 0;
-	
-	_state = newstate;
+	_idle_naks = naks;
+	_idle_max_interval = max_interval;
 }
 
-void SoftUsb::wait(int n)
+const softusb_poll_stats_t *SoftUsb::get_poll_stats()
 {
-	unsigned int t;
-	int i;
-	for (i = 0; i < n; i++)
+	return &_poll_stats;
+}
+
+void SoftUsb::reset_poll_stats()
+{
+	_poll_stats.polls = 0;
+	_poll_stats.reports = 0;
+	_poll_stats.naks = 0;
+	_poll_stats.errors = 0;
+	_poll_stats.duplicates = 0;
+	_poll_stats.unchanged = 0;
+}
+
+void SoftUsb::set_fast_enumeration(int enable)
+{
+	_fast_enum = enable != 0;
+}
+
+int SoftUsb::get_fast_enumeration()
+{
+	return _fast_enum;
+}
+
+void SoftUsb::set_control_budget(unsigned int budget)
+{
+	_control_budget = budget;
+}
+
+unsigned int SoftUsb::get_frame_ticks()
+{
+	return _frame_ticks;
+}
+
+void SoftUsb::set_cache(SoftUsbCache *cache)
+{
+	_cache = cache;
+}
+
+void SoftUsb::set_hid_protocol(int protocol)
+{
+	_hid_protocol = protocol;
+}
+
+void SoftUsb::set_idle_rate(int rate)
+{
+	_idle_rate = rate;
+}
+
+// Pause before the next enumeration stage after ACK, NAK and timeout
+// retries always wait SOFTUSB_PACKET_PAUSE_MS
+unsigned int SoftUsb::stage_pause()
+{
+	return _fast_enum ? 0 : SOFTUSB_PACKET_PAUSE_MS;
+}
+
+int SoftUsb::get_endpoint_interval(int index)
+{
+	if (_poll_interval > 0)
 	{
-		SOFTUSB_WAIT;
+		return _poll_interval;
 	}
+	
+	if (index < 0 || index >= _endpoint_count)
+	{
+		return SOFTUSB_DEFAULT_INTERVAL;
+	}
+	
+	return _endpoints[index].descr.interval > 0 ? _endpoints[index].descr.interval : 1;
 }
 
-void SoftUsb::eop()
+const unsigned char *SoftUsb::get_device_report()
 {
-	unsigned int t;
-	SOFTUSB_WAIT;
-	SOFTUSB_Z;
-	SOFTUSB_WAIT;
-	SOFTUSB_WAIT;
-	SOFTUSB_M;
-	SOFTUSB_WAIT;
+	return _report;
+}
+
+void SoftUsb::set_raw_reports(int enable)
+{
+	_raw_reports = enable != 0;
+}
+
+const softusb_raw_report_t *SoftUsb::get_raw_report()
+{
+	int index = _raw_index;
+	
+	// Timer interrupt doesn't write the slot used by application
+	_raw_reading = index;
+	
+	SOFTUSB_MEMORY_BARRIER;
+	
+	return &_raw[index];
+}
+
+unsigned short SoftUsb::get_vendor_id()
+{
+	return _vendor_id;
+}
+
+unsigned short SoftUsb::get_device_id()
+{
+	return _vendor_id;
 }
 
-void SoftUsb::keepalive()
+int SoftUsb::getch()
 {
-	unsigned int v;
+	unsigned char res;
+	
+	if (!_keyb_chars_buffer.get(res))
+	{
+		return 0;
+	}
 	
-	SOFTUSB_READ(v);
-	v &= _mpmask;
+	return res;
+}
+
+int SoftUsb::kbhit()
+{
+	return !_keyb_chars_buffer.is_empty();
+}
+
+int SoftUsb::get_key_code()
+{
+	unsigned char res;
 	
-	if (v != _mmask)
+	if (!_keyb_buffer.get(res))
 	{
-		set_state(su_nodevice);
-		_timer = DEBOUNCE_MS;
-		return;
+		return 0;
 	}
 	
-	SOFTUSB_OUTPUT;
+	return res;
+}
+
+int SoftUsb::read_key_codes(unsigned char *codes, int max)
+{
+	return _keyb_buffer.read(codes, max);
+}
+
+int SoftUsb::get_lock_state()
+{
+	return _keyb_locks;
+}
+
+void SoftUsb::set_lock_state(int locks)
+{
+	_keyb_locks = locks & (KEYBOARD_LOCK_NUM | KEYBOARD_LOCK_CAPS | KEYBOARD_LOCK_SCROLL);
+}
+
+void SoftUsb::get_mouse_pos(int &x, int &y, int &buttons, int &wheel)
+{
+	softusb_mouse_state_t state;
+	
+	get_mouse_state(state);
 	
-	eop();
+	x = state.x;
+	y = state.y;
+	buttons = state.buttons;
+	wheel = state.wheel;
+}
+
+void SoftUsb::get_mouse_state(softusb_mouse_state_t &state)
+{
+	unsigned int seq;
 	
-	SOFTUSB_INPUT;
+	// Retry if the timer interrupt has updated the state while copying
+	do
+	{
+		seq = _mouse_seq;
+		
+		SOFTUSB_MEMORY_BARRIER;
+		
+		state = _mouse;
+		
+		SOFTUSB_MEMORY_BARRIER;
+	} while ((seq & 1) || seq != _mouse_seq);
 }
 
-// Send packet
-void SoftUsb::send(unsigned char *data, int count)
+void SoftUsb::consume_mouse_deltas(int &dx, int &dy, int &dwheel, int &buttons)
 {
-	unsigned int t;
-	int i, j;
-	unsigned int b = _m;
+	softusb_mouse_state_t state;
+	
+	get_mouse_state(state);
+	
+	// Totals are only written by the interrupt, so nothing is lost between calls.
+	// They wrap around, the difference is still right
+	dx = (int)(state.dx - _mouse_consumed_dx);
+	dy = (int)(state.dy - _mouse_consumed_dy);
+	dwheel = (int)(state.dwheel - _mouse_consumed_dwheel);
+	buttons = state.buttons;
+	
+	_mouse_consumed_dx = state.dx;
+	_mouse_consumed_dy = state.dy;
+	_mouse_consumed_dwheel = state.dwheel;
+}
 
-	SOFTUSB_OUTPUT;
+void SoftUsb::add_key(int code)
+{
+	int shift;
 	
-	SOFTUSB_M;
+	_keyb_buffer.add(code);
+	
+	if (code & 0x80)
+	{
+		return;
+	}
 	
-	SOFTUSB_WAIT;
+	shift = _keyb_control & KEYBOARD_CONTROL_SHIFT;
 	
-	SOFTUSB_BEGIN_INTERVAL;
+	// Caps Lock changes letters only
+	if ((_keyb_locks & KEYBOARD_LOCK_CAPS) && ascii_lower[code] >= 'a' && ascii_lower[code] <= 'z')
+	{
+		shift = !shift;
+	}
 	
-	for (i = 0; i < count; i++)
+	if (shift)
 	{
-		for (j = 0; j < 8; j++)
-		{
-			if ((data[i] & (1 << j)) == 0)
-				b ^= _m | _p;
-			SOFTUSB_WAIT_TICK;
-			SOFTUSB_OUT(b);
-			SOFTUSB_BEGIN_INTERVAL;
-		}
+		code = ascii_upper[code];
 	}
+	else
+	{
+		code = ascii_lower[code];
+	}
+	
+	if (code == 0)
+	{
+		return;
+	}
+	
+	_keyb_chars_buffer.add(code);
+}
 
-	SOFTUSB_WAIT_TICK;
+void SoftUsb::set_state(SoftUsbState newstate)
+{
+	_timer = 0;
+	_state_timer = 0;
+	_retries = 0;
 	
-	SOFTUSB_Z;
-	SOFTUSB_WAIT;
-	SOFTUSB_WAIT;
-	SOFTUSB_M;
+	_state = newstate;
+}
 
-	SOFTUSB_BEGIN_INTERVAL;
+void SoftUsb::wait(int n)
+{
+	unsigned int t;
+	int i;
+	for (i = 0; i < n; i++)
+	{
+		SOFTUSB_WAIT;
+	}
+}
 
-	SOFTUSB_INPUT;
+// Line level functions with pins set at runtime
+#define SOFTUSB_PHY_TEMPLATE
+#define SOFTUSB_PHY_CLASS		SoftUsb
+#include "softusb_phy.h"
+#undef SOFTUSB_PHY_TEMPLATE
+#undef SOFTUSB_PHY_CLASS
 
-	SOFTUSB_WAIT;
+// Send packet
+void SoftUsb::send(const unsigned char *data, int count)
+{
+#ifdef SOFTUSB_DMA_TX
+	unsigned int *wave = _wave;
+#else
+	unsigned int wave[SOFTUSB_WAVE_SIZE];
+#endif
+	int n;
+	
+	n = encode(data, count, wave);
+	
+	transmit(wave, n);
 }
 
 // Create token with addr and ep values
 int SoftUsb::token_data(int addr, int ep)
 {
-	unsigned short b = 0x1F;
-	int i;
-	unsigned short a = addr + ep * 128;
-	unsigned short d = a;
+	unsigned int b = 0x1F;
+	unsigned int a = addr + ep * 128;
 	
-	for (i = 0; i <= 10; i++)
-	{
-		if ((d ^ b) & 1)
-		{
-			b >>= 1;
-			b ^= 0x14;
-		}
-		else
-			b >>= 1;
-		d >>= 1;
-	}
+	// 11 bits of token: 4 + 4 + 3
+	b ^= a & 0x0F;
+	b = (b >> 4) ^ crc5_table[b & 0x0F];
+	b ^= (a >> 4) & 0x0F;
+	b = (b >> 4) ^ crc5_table[b & 0x0F];
+	b ^= (a >> 8) & 0x07;
+	b = (b >> 3) ^ crc5_table3[b & 0x07];
 	
 	b ^= 0x1F;
 	
@@ -469,22 +970,16 @@ int SoftUsb::token_data(int addr, int ep)
 }
 
 // USB CRC16
-unsigned short SoftUsb::crc16(const unsigned char *data, int count)
+unsigned short softusb_crc16(const unsigned char *data, int count)
 {
-	int i, j;
-	unsigned short crc = 0xFFFFu;
+	int i;
+	unsigned int crc = 0xFFFFu;
 	
 	for (i = 0; i < count; i++)
 	{
 		crc ^= data[i];
-		
-		for (j = 0; j < 8; j++)
-		{
-			if (crc & 0x0001)
-				crc = (crc >> 1) ^ 0xA001;
-			else
-				crc = crc >> 1;
-		}
+		CRC16_NIBBLE(crc);
+		CRC16_NIBBLE(crc);
 	}
 	
 	return crc ^ 0xFFFFu;
@@ -493,94 +988,118 @@ unsigned short SoftUsb::crc16(const unsigned char *data, int count)
 void SoftUsb::send_token(int pid, int addr, int ep)
 {
 	unsigned char buf[4];
+	const unsigned char *packet = buf;
 	unsigned short data;
 	
-	data = token_data(addr, ep);
-	
-	buf[0] = 0x80;
-	buf[1] = pid;
-	buf[2] = data & 0xFF;
-	buf[3] = data >> 8;
+	if ((addr == 0 || addr == SOFTUSB_DEVICE_ADDRESS) && ep <= 1)
+	{
+		packet = token_packets[TOKEN_INDEX(pid)][addr != 0][ep];
+	}
+	else
+	{
+		data = token_data(addr, ep);
+		
+		buf[0] = 0x80;
+		buf[1] = pid;
+		buf[2] = data & 0xFF;
+		buf[3] = data >> 8;
+	}
 	
-	SOFTUSB_OUTPUT;
+	line_output();
 	
 	eop();
 
-	send(buf, sizeof(buf));
+	send(packet, sizeof(buf));
 }
 
-// This is the most important function
-// We should run very quickly
-// The timer used to measure bit intervals should be very accurate
-int SoftUsb::receive(unsigned char *buffer, int n)
+// Decode packet from line samples taken with "period" samples per bit
+// (fixed point, 1/256 of a sample). Returns number of bytes or -1 if
+// there is no packet. Bit clock is resynchronized on every transition.
+int softusb_decode(const softusb_sample_t *samples, int count, unsigned int period,
+	unsigned int mmask, unsigned int pmask, unsigned char *buffer, int n)
 {
-	unsigned int t;
-	int res = 0;
-	int i, j;
-	unsigned int v = _pmask, g = _mmask;
+	int i = 0, k, last;
+	int bits = 0;
 	int ones = 0;
-	volatile int w;
-
-	// Wait for response
+	unsigned int res = 0;
+	unsigned int mpmask = mmask | pmask;
+	unsigned int s, prev = mmask;
+	unsigned int next;
+	
+	// Find first K of SYNC
+	while (i < count && (samples[i] & mpmask) != pmask)
+	{
+		i++;
+	}
+	
+	if (i >= count)
+	{
+		return -1;
+	}
+	
+	// Transition is half a sample before the first K
+	next = (i << 8) - 128 + period / 2;
 	i = 0;
-	while (1)
+	
+	while (i < n)
 	{
-		SOFTUSB_READ(g);
+		// Nearest sample to the bit centre
+		k = (next + 128) >> 8;
 		
-		if (g & _pmask)
+		if (k >= count)
 		{
 			break;
 		}
 		
-		if (i++ > 10000)
-			return -1;
-	}
-	
-	t = 0;
-	
-	TIMER_1500_KHZ_SYNC;
-	
-	for (i = 0; i < n; i++)
-	{
-		for (j = i == 0; j < 8; j++)
+		s = samples[k] & mpmask;
+		
+		// Detect EOP
+		if (s == 0)
+		{
+			break;
+		}
+		
+		if (ones == 6)
+		{
+			// Stuffed bit
+			ones = 0;
+		}
+		else
 		{
-			SOFTUSB_WAIT_TICK;
-			SOFTUSB_BEGIN_INTERVAL;
 			res >>= 1;
-			SOFTUSB_READ(g);
-			g &= _mpmask;
 			
-			// Detect EOP
-			if (g == 0)
-			{
-				break;
-			}
-			
-			if ((v ^ g) == 0)
+			if (s == prev)
 			{
 				res |= 0x80;
 				ones++;
-				if (ones == 6)
-				{
-					ones = 0;
-					SOFTUSB_WAIT_TICK;
-					SOFTUSB_BEGIN_INTERVAL;
-					SOFTUSB_READ(g);
-					g &= _mpmask;
-				}
 			}
 			else
+			{
 				ones = 0;
-			v = g;
+			}
+			
+			if (++bits == 8)
+			{
+				buffer[i++] = res;
+				bits = 0;
+				res = 0;
+			}
 		}
 		
-		if (g == 0)
+		prev = s;
+		
+		// Resync to a transition before the next bit
+		next += period;
+		last = (next + 128) >> 8;
+		
+		for (k++; k <= last && k < count; k++)
 		{
-			break;
+			if ((samples[k] & mpmask) != s)
+			{
+				next = (k << 8) - 128 + period / 2;
+				break;
+			}
 		}
-		
-		buffer[i] = res;
-		res = 0;
 	}
 	
 	return i;
@@ -591,7 +1110,7 @@ int SoftUsb::usb_write(int trans_type, int addr, int ep, const unsigned char *da
 {
 	unsigned char buf[12];
 	int i;
-	unsigned short crc = crc16(data, count);
+	unsigned short crc = softusb_crc16(data, count);
 	
 	if (count > 8)
 	{
@@ -601,8 +1120,6 @@ int SoftUsb::usb_write(int trans_type, int addr, int ep, const unsigned char *da
 	buf[0] = 0x80;
 	buf[1] = trans_type == TRANS_OUT ? DATA_DATA1 : DATA_DATA0;
 	
-	_data_0 = !_data_0;
-	
 	for (i = 0; i < count; i++)
 	{
 		buf[2 + i] = data[i];
@@ -611,12 +1128,30 @@ int SoftUsb::usb_write(int trans_type, int addr, int ep, const unsigned char *da
 	buf[2 + count] = crc & 0xFF;
 	buf[3 + count] = crc >> 8;
 
+	return usb_write_packet(trans_type, addr, ep, buf, 4 + count);
+}
+
+// Send complete DATA packet (SYNC, PID, data, CRC16)
+int SoftUsb::usb_write_packet(int trans_type, int addr, int ep, const unsigned char *packet, int size)
+{
+	unsigned char buf[2];
+	int i;
+#ifdef SOFTUSB_TRACE
+	trace_begin();
+#endif
+	
+	_data_0 = !_data_0;
+	
 	send_token(trans_type, addr, ep);
 	
-	send(buf, 4 + count);
+	send(packet, size);
 	
 	i = receive(buf, 2);
 
+#ifdef SOFTUSB_TRACE
+	trace(trans_type, addr, ep, packet[1], i == 2 ? buf[1] : 0, packet + 2, size - 4);
+#endif
+
 	if (i == 2)
 	{
 		return buf[1];
@@ -628,94 +1163,111 @@ int SoftUsb::usb_write(int trans_type, int addr, int ep, const unsigned char *da
 int SoftUsb::usb_read(int trans_type, int addr, int ep, unsigned char *buffer)
 {
 	unsigned char buf[SOFTUSB_BUFFER_SIZE];
-	unsigned char buf1[SOFTUSB_BUFFER_SIZE];
 	int i, n;
-	unsigned short crc;
+	
+	n = usb_read_packet(trans_type, addr, ep, buf);
+	
+	if (n > 0 && n <= SOFTUSB_MAX_PACKET)
+	{
+		for (i = 0; i < n; i++)
+		{
+			buffer[i] = buf[2 + i];
+		}
+	}
+	
+	return n;
+}
+
+// Receive whole packet, SOFTUSB_MAX_PACKET bytes, returns its length or handshake
+int SoftUsb::usb_read_packet(int trans_type, int addr, int ep, unsigned char *buf)
+{
+	const unsigned char *handshake = ack_packet;
+	int i, n;
+#ifdef SOFTUSB_TRACE
+	trace_begin();
+#endif
 	
 	// Erase CRC
-	for (i = 8; i < sizeof(buf); i++)
+	for (i = 8; i < SOFTUSB_MAX_PACKET; i++)
 	{
 		buf[i] = i;
 	}
 	
 	send_token(trans_type, addr, ep);
 	
-	n = receive(buf, 12);
+	n = receive(buf, SOFTUSB_MAX_PACKET);
 	
-	SOFTUSB_OUTPUT;
-
-	buf1[0] = 0x80;
-	buf1[1] = HANDSHAKE_ACK;
+	line_output();
 	
+	_rx_pid = n >= 2 ? buf[1] : 0;
+
 	if (buf[1] == DATA_DATA0 || buf[1] == DATA_DATA1)
 	{
-		crc = crc16(&buf[2], n - 4);
-		
-		if ((buf[n - 2] != (crc & 0xFF)) || (buf[n - 1] != (crc >> 8)))
+		// CRC was checked by receive()
+		if (n < 4 || _rx_crc != CRC16_RESIDUAL)
 		{
-			buf1[1] = HANDSHAKE_NAK;
+			handshake = nak_packet;
 		}
 	}
 	
-	send(buf1, 2);
+	send(handshake, 2);
 	
-	if (n < 2)
+#ifdef SOFTUSB_TRACE
+	trace(trans_type, addr, ep, n >= 2 ? buf[1] : 0, n >= 2 ? handshake[1] : 0, buf + 2, n - 4);
+#endif
+	
+	if (n < 2)
 	{
 		return -1;
 	}
 	
-	if (buf1[1] == HANDSHAKE_NAK)
+	if (handshake == nak_packet)
 	{
 		return HANDSHAKE_NAK;
 	}
 	
-	if (n > SOFTUSB_BUFFER_SIZE)
-	{
-		n = SOFTUSB_BUFFER_SIZE;
-	}
-	
 	if ((buf[1] != DATA_DATA0) && (buf[1] != DATA_DATA1))
 	{
 		return buf[1];
 	}
 	
-	for (i = 0; i < n; i++)
-	{
-		buffer[i] = buf[2+ i];
-	}
-	
 	return n;
 }
 
 // State machine
 void SoftUsb::process_nodevice()
 {
-	unsigned int v;
+	int v;
 	
-	SOFTUSB_INPUT;
+	line_input();
 	
-	SOFTUSB_READ(v);
+	v = read_line();
 	
-	if (v & _pmask)
+	if (v & SOFTUSB_LINE_DP)
 	{
 		set_state(su_fullspeed);
 		return;
 	}
 
-	if (v & _mmask)
+	if (v & SOFTUSB_LINE_DM)
 	{
 		set_state(su_debounce);
-		_timer = DEBOUNCE_MS;
+		
+		// Fast enumeration checks the line every 1 ms instead of waiting
+		if (_fast_enum)
+		{
+			_state_timer = SOFTUSB_FAST_DEBOUNCE_MS;
+		}
+		else
+		{
+			_timer = DEBOUNCE_MS;
+		}
 	}
 }
 
 void SoftUsb::process_fullspeed()
 {
-	unsigned int v;
-	
-	SOFTUSB_READ(v);
-	
-	if (v & _pmask)
+	if (read_line() & SOFTUSB_LINE_DP)
 	{
 		return;
 	}
@@ -725,38 +1277,37 @@ void SoftUsb::process_fullspeed()
 
 void SoftUsb::process_debounce()
 {
-	unsigned int v;
-	
-	SOFTUSB_READ(v);
+	if (!(read_line() & SOFTUSB_LINE_DM))
+	{
+		set_state(su_nodevice);
+		return;
+	}
 	
-	if (v & _mmask)
+	// Line must stay idle until the end of debounce interval
+	if (_state_timer > 0)
 	{
-		set_state(su_reset);
-		_timer = RESET_MS;
-		SOFTUSB_Z;
-		SOFTUSB_OUTPUT;
+		_state_timer--;
 		return;
 	}
 	
-	set_state(su_nodevice);
+	set_state(su_reset);
+	_timer = RESET_MS;
+	line_reset();
 }
 
 void SoftUsb::process_reset()
 {
-	SOFTUSB_M;
-	SOFTUSB_INPUT;
+	line_idle();
 	
 	set_state(su_connected);
-	_state_timer = 100;
+	_state_timer = _fast_enum ? SOFTUSB_RESET_RECOVERY_MS : 100;
 }
 
 void SoftUsb::process_connected()
 {
 	int res;
 
-	const unsigned char get_descriptor[8] = {0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00};
-	
-	res = usb_write(TRANS_SETUP, 0, 0, get_descriptor, sizeof(get_descriptor));
+	res = usb_write_packet(TRANS_SETUP, 0, 0, get_device_descriptor_packet, sizeof(get_device_descriptor_packet));
 	
 	if (res != HANDSHAKE_ACK)
 	{
@@ -775,7 +1326,6 @@ void SoftUsb::process_connected()
 	_descr_offset = 0;
 	
 	set_state(su_read_descr);
-	_state_timer = SOFTUSB_PACKET_PAUSE_MS;
 }
 
 void SoftUsb::process_read_descr()
@@ -822,18 +1372,46 @@ void SoftUsb::process_read_descr()
 		_vendor_id = _descriptor[9] * 256 + _descriptor[8];
 		_device_id = _descriptor[11] * 256 + _descriptor[10];
 		
-		set_state(su_set_address);
+		control_status(0, su_set_address);
+	}
+}
+
+// Zero length OUT packet ends a control read
+void SoftUsb::control_status(int addr, SoftUsbState next)
+{
+	set_state(su_control_status);
+	_status_addr = addr;
+	_status_next = next;
+}
+
+void SoftUsb::process_control_status()
+{
+	int res;
+	
+	res = usb_write(TRANS_OUT, _status_addr, 0, 0, 0);
+	
+	if (res != HANDSHAKE_ACK)
+	{
+		_retries++;
 		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+		
+		if (_retries > SOFTUSB_RETRIES)
+		{
+			set_state(su_nodevice);
+		}
+		
+		return;
 	}
+	
+	set_state(_status_next);
+	_state_timer = stage_pause();
 }
 
 void SoftUsb::process_set_address()
 {
 	int res;
 	
-	const unsigned char set_address[8] = {0x00, 0x05, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00};
-
-	res = usb_write(TRANS_SETUP, 0, 0, set_address, sizeof(set_address));
+	res = usb_write_packet(TRANS_SETUP, 0, 0, set_address_packet, sizeof(set_address_packet));
 
 	if (res != HANDSHAKE_ACK)
 	{
@@ -872,16 +1450,14 @@ void SoftUsb::process_wait_address()
 	}
 	
 	set_state(su_set_conf);
-	_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+	_state_timer = _fast_enum ? SOFTUSB_ADDRESS_RECOVERY_MS : SOFTUSB_PACKET_PAUSE_MS;
 }
 
 void SoftUsb::process_set_conf()
 {
 	int res;
 	
-	const unsigned char set_configuration[8] = {0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00};
-
-	res = usb_write(TRANS_SETUP, 1, 0, set_configuration, sizeof(set_configuration));
+	res = usb_write_packet(TRANS_SETUP, SOFTUSB_DEVICE_ADDRESS, 0, set_configuration_packet, sizeof(set_configuration_packet));
 
 	if (res != HANDSHAKE_ACK)
 	{
@@ -904,7 +1480,7 @@ void SoftUsb::process_wait_conf()
 	int res;
 	unsigned char buf[SOFTUSB_BUFFER_SIZE];
 
-	res = usb_read(TRANS_IN, 1, 0, buf);
+	res = usb_read(TRANS_IN, SOFTUSB_DEVICE_ADDRESS, 0, buf);
 
 	if (res <= 0)
 	{
@@ -919,231 +1495,363 @@ void SoftUsb::process_wait_conf()
 		return;
 	}
 	
+	// Known device is ready to work
+	if (load_cached())
+	{
+		start_hid_requests();
+		return;
+	}
+	
+	_cache_store = _cache != 0;
+	
 	set_state(su_query_conf_descr);
-	_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+	_state_timer = stage_pause();
 }
 
-void SoftUsb::process_query_conf_descr()
+// Protocol and idle rate of HID interfaces
+void SoftUsb::start_hid_requests()
 {
-	int res;
+	set_state(su_set_hid);
+	_state_timer = stage_pause();
+	_hid_intf = 0;
+	_hid_step = 0;
+}
+
+// Next HID class request, 0 if all are done
+int SoftUsb::next_hid_request(unsigned char *request)
+{
+	const softusb_interface_t *intf;
+	int i;
+	
+	for (; _hid_intf < _interface_count; _hid_intf++, _hid_step = 0)
+	{
+		intf = &_interfaces[_hid_intf];
+		
+		if (intf->descr.interface_class != 3)
+		{
+			continue;
+		}
+		
+		// Boot interfaces start in report protocol, set it if reports are decoded
+		// with boot layout or report protocol is requested
+		if (_hid_step == 0)
+		{
+			if (intf->descr.interface_subclass == 1 &&
+				(intf->boot_layout || _hid_protocol == SOFTUSB_PROTOCOL_REPORT))
+			{
+				for (i = 0; i < 8; i++)
+				{
+					request[i] = set_protocol_request[i];
+				}
+				
+				request[2] = !intf->boot_layout;
+				request[4] = intf->descr.interface_number;
+				return 1;
+			}
+			
+			_hid_step++;
+		}
+		
+		// Keyboards repeat the last report at their idle rate, 500 ms by default
+		if (_hid_step == 1)
+		{
+			if (intf->type & USB_DEVICE_KEYBOARD)
+			{
+				for (i = 0; i < 8; i++)
+				{
+					request[i] = set_idle_request[i];
+				}
+				
+				request[3] = _idle_rate;
+				request[4] = intf->descr.interface_number;
+				return 1;
+			}
+			
+			_hid_step++;
+		}
+	}
+	
+	return 0;
+}
 
-	const unsigned char get_descriptor[8] = {0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0x12, 0x00};
+void SoftUsb::process_set_hid()
+{
+	int res;
+	unsigned char request[8];
+	
+	if (!next_hid_request(request))
+	{
+		start_polling();
+		return;
+	}
 	
-	res = usb_write(TRANS_SETUP, 1, 0, get_descriptor, sizeof(get_descriptor));
+	res = usb_write(TRANS_SETUP, SOFTUSB_DEVICE_ADDRESS, 0, request, 8);
 	
 	if (res != HANDSHAKE_ACK)
 	{
 		_retries++;
 		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
 		
+		// The requests are optional, go to the next one
 		if (_retries > SOFTUSB_RETRIES)
 		{
-			set_state(su_nodevice);
+			_hid_step++;
+			set_state(su_set_hid);
 		}
 		
 		return;
 	}
 	
-	_data_0 = 1;
-	
-	_descr_offset = 0;
-
-	set_state(su_read_conf_descr);
-	_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+	set_state(su_wait_hid);
 }
 
-void SoftUsb::process_read_conf_descr()
+void SoftUsb::process_wait_hid()
 {
 	int res;
 	unsigned char buf[SOFTUSB_BUFFER_SIZE];
-	int i;
-
-	res = usb_read(TRANS_IN, 1, 0, buf);
-
-	if (res <= 0 || res == HANDSHAKE_NAK)
+	
+	res = usb_read(TRANS_IN, SOFTUSB_DEVICE_ADDRESS, 0, buf);
+	
+	// Zero length DATA1, STALL if the request is not supported
+	if (res != 4 && res != HANDSHAKE_STALL)
 	{
 		_retries++;
 		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
 		
+		// The requests are optional, go to the next one
 		if (_retries > SOFTUSB_RETRIES)
 		{
-			set_state(su_nodevice);
+			_hid_step++;
+			set_state(su_set_hid);
 		}
 		
 		return;
 	}
 	
+	_hid_step++;
+	set_state(su_set_hid);
+	_state_timer = stage_pause();
+}
+
+// Lock state differs from keyboard LEDs
+int SoftUsb::has_output_report()
+{
+	return _state == su_work && _led_intf >= 0 && _keyb_locks != _leds_sent;
+}
+
+void SoftUsb::process_set_report()
+{
+	int res;
+	unsigned char request[8];
+	const softusb_interface_t *intf = &_interfaces[_led_intf];
+	int i;
+	
 	for (i = 0; i < 8; i++)
 	{
-		if (i + _descr_offset >= sizeof(_conf_descriptor))
-		{
-			break;
-		}
-		
-		_conf_descriptor[i + _descr_offset] = buf[i];
+		request[i] = set_report_request[i];
 	}
 	
-	_descr_offset += 8;
+	request[2] = intf->led_report_id;
+	request[4] = intf->descr.interface_number;
+	request[6] = intf->led_report_id ? 2 : 1;
 	
-	if (_descr_offset < 18)
-	{
-		_data_0 = !_data_0;
-	}
-	else
+	res = usb_write(TRANS_SETUP, SOFTUSB_DEVICE_ADDRESS, 0, request, 8);
+	
+	if (res != HANDSHAKE_ACK)
 	{
-		set_state(su_work);
+		_retries++;
 		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
-	}
-}
-
-static int is_in_list(const unsigned char *list, int size, unsigned char value)
-{
-	int i;
-	for (i = 0; i < size; i++)
-	{
-		if (list[i] == value)
+		
+		// Not repeated for this lock state
+		if (_retries > SOFTUSB_RETRIES)
 		{
-			return 1;
+			_leds_value = _keyb_locks;
+			finish_output_report();
 		}
+		
+		return;
 	}
-	return 0;
+	
+	// Later changes wait for the next transfer
+	_leds_value = _keyb_locks;
+	
+	set_state(su_report_data);
 }
 
-void SoftUsb::parse_keyboard_report()
+void SoftUsb::process_report_data()
 {
-	int i, found = 1;
-	unsigned char t;
-	unsigned char code;
+	int res;
+	unsigned char data[2];
+	const softusb_interface_t *intf = &_interfaces[_led_intf];
+	int n = 0;
 	
-	// Read control keys
-	_keyb_control = _report[0];
+	if (intf->led_report_id)
+	{
+		data[n++] = intf->led_report_id;
+	}
 	
-	// Don't need right control keys
-	if (_keyb_control & 0x08) _keyb_control |= 0x01;
-	if (_keyb_control & 0x10) _keyb_control |= 0x02;
-	if (_keyb_control & 0x20) _keyb_control |= 0x04;
+	data[n++] = _leds_value;
 	
-	// Read keys
-	for (i = 0; i < HID_MAX_PRESSED_KEYS; i++)
+	res = usb_write(TRANS_OUT, SOFTUSB_DEVICE_ADDRESS, 0, data, n);
+	
+	// Keyboard without LEDs
+	if (res == HANDSHAKE_STALL)
 	{
-		_keys_pressed[i] = _report[2 + i];
+		finish_output_report();
+		return;
 	}
 	
-	// Bubble-sort keys
-	while (found)
+	if (res != HANDSHAKE_ACK)
 	{
-		found = 0;
-		for (i = 0; i < HID_MAX_PRESSED_KEYS - 1; i++)
+		_retries++;
+		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+		
+		if (_retries > SOFTUSB_RETRIES)
 		{
-			if (_keys_pressed[i] < _keys_pressed[i + 1])
-			{
-				t = _keys_pressed[i];
-				_keys_pressed[i] = _keys_pressed[i + 1];
-				_keys_pressed[i + 1] = t;
-				found = 1;
-			}
+			finish_output_report();
 		}
+		
+		return;
 	}
 	
-	// Check released keys
-	for (i = 0; i < HID_MAX_PRESSED_KEYS; i++)
+	set_state(su_report_status);
+}
+
+void SoftUsb::process_report_status()
+{
+	int res;
+	unsigned char buf[SOFTUSB_BUFFER_SIZE];
+	
+	res = usb_read(TRANS_IN, SOFTUSB_DEVICE_ADDRESS, 0, buf);
+	
+	// Zero length DATA1 or STALL
+	if (res != 4 && res != HANDSHAKE_STALL)
 	{
-		code = _keys_pressed_prev[i];
-		if (code == 0)
-		{
-			break;
-		}
+		_retries++;
+		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
 		
-		if (!is_in_list(_keys_pressed, sizeof(_keys_pressed), code))
+		if (_retries > SOFTUSB_RETRIES)
 		{
-			// Key released
-			code = xt_codes[code];
-			
-			if (code > 0)
-			{
-				add_key(code | 0x80);
-			}
+			finish_output_report();
 		}
+		
+		return;
 	}
+	
+	finish_output_report();
+}
+
+// Back to polling, a failed report is not repeated until the lock state changes
+void SoftUsb::finish_output_report()
+{
+	_leds_sent = _leds_value;
+	
+	set_state(su_work);
+	wait_endpoints();
+}
+
+void SoftUsb::process_query_conf_descr()
+{
+	int res;
+	unsigned char request[8];
+	int i;
 
-	// Check pressed keys
-	for (i = 0; i < HID_MAX_PRESSED_KEYS; i++)
+	if (_conf_length == 0)
+	{
+		// Configuration descriptor header only to get wTotalLength
+		res = usb_write_packet(TRANS_SETUP, SOFTUSB_DEVICE_ADDRESS, 0, get_conf_descriptor_packet, sizeof(get_conf_descriptor_packet));
+		_conf_length = SOFTUSB_CONF_DESCR_SIZE;
+	}
+	else
 	{
-		code = _keys_pressed[i];
-		if (code == 0)
+		for (i = 0; i < 8; i++)
 		{
-			break;
+			request[i] = get_conf_descriptor_request[i];
 		}
 		
-		if (!is_in_list(_keys_pressed_prev, sizeof(_keys_pressed_prev), code))
-		{
-			// Key pressed
-			code = xt_codes[code];
-			
-			if (code > 0)
-			{
-				add_key(code);
-			}
-		}
+		request[6] = _conf_length & 0xFF;
+		request[7] = _conf_length >> 8;
+		
+		res = usb_write(TRANS_SETUP, SOFTUSB_DEVICE_ADDRESS, 0, request, 8);
 	}
-
-	// Save keys state
-	for (i = 0; i < HID_MAX_PRESSED_KEYS; i++)
+	
+	if (res != HANDSHAKE_ACK)
 	{
-		_keys_pressed_prev[i] = _keys_pressed[i];
+		_retries++;
+		_conf_length = 0;
+		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+		
+		if (_retries > SOFTUSB_RETRIES)
+		{
+			set_state(su_nodevice);
+		}
+		
+		return;
 	}
-}
-
-void SoftUsb::parse_mouse_report()
-{
-	signed char dx, dy, dw;
-
-	dx = _report[1];
-	dy = _report[2];
-	dw = _report[3];
-	_mouse_b = _report[0];
-	_mouse_x += dx;
-	_mouse_y += dy;
-	_mouse_wheel += dw;
 	
-	if (_mouse_x < MOUSE_LEFT_LIMIT) _mouse_x = MOUSE_LEFT_LIMIT;
-	if (_mouse_x > MOUSE_RIGHT_LIMIT) _mouse_x = MOUSE_RIGHT_LIMIT;
-	if (_mouse_y < MOUSE_TOP_LIMIT) _mouse_y = MOUSE_TOP_LIMIT;
-	if (_mouse_y > MOUSE_BOTTOM_LIMIT) _mouse_y = MOUSE_BOTTOM_LIMIT;
+	_data_0 = 1;
+	
+	_descr_offset = 0;
+	
+	_parse_pos = 0;
+	_parse_intf = -1;
+	_interface_count = 0;
+	_endpoint_count = 0;
+
+	set_state(su_read_conf_descr);
 }
 
-void SoftUsb::process_work()
+void SoftUsb::process_read_conf_descr()
 {
 	int res;
 	unsigned char buf[SOFTUSB_BUFFER_SIZE];
+	unsigned int total;
 	int i;
-	
-	res = usb_read(TRANS_IN, 1, 1, buf);
 
-	if (res > 0 && res <= 12)
+	res = usb_read(TRANS_IN, SOFTUSB_DEVICE_ADDRESS, 0, buf);
+
+	// Should be SYNC, PID, up to 8 bytes and CRC
+	if (res < 4 || res > 12)
 	{
-		for (i = 0; i < 8; i++)
+		_retries++;
+		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+		
+		if (_retries > SOFTUSB_RETRIES)
 		{
-			_report[i] = buf[i];
+			set_state(su_nodevice);
 		}
 		
-		switch (get_device_type())
+		return;
+	}
+	
+	res -= 4;
+	
+	for (i = 0; i < res && _descr_offset < _conf_length; i++)
+	{
+		if (_descr_offset < sizeof(_conf_descriptor))
 		{
-			case USB_DEVICE_KEYBOARD:
-				parse_keyboard_report();
-				break;
-			case USB_DEVICE_MOUSE:
-				parse_mouse_report();
-				break;
+			_conf_descriptor[_descr_offset] = buf[i];
 		}
+		
+		parse_conf_byte(buf[i]);
+		
+		_descr_offset++;
 	}
-	else if (res == HANDSHAKE_NAK)
+	
+	// Short packet ends the descriptor
+	if (res == 8 && _descr_offset < _conf_length)
 	{
+		_data_0 = !_data_0;
+		return;
 	}
-	else
+	
+	_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+	
+	if (_descr_offset < SOFTUSB_CONF_DESCR_SIZE)
 	{
 		_retries++;
-		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+		_conf_length = 0;
+		set_state(su_query_conf_descr);
 		
 		if (_retries > SOFTUSB_RETRIES)
 		{
@@ -1152,4 +1860,1842 @@ void SoftUsb::process_work()
 		
 		return;
 	}
+	
+	total = get_conf_descriptor()->total_length[1] * 256 + get_conf_descriptor()->total_length[0];
+	
+	// Read interfaces and endpoints
+	if (_conf_length == SOFTUSB_CONF_DESCR_SIZE && total > _conf_length)
+	{
+		_conf_length = total;
+		control_status(SOFTUSB_DEVICE_ADDRESS, su_query_conf_descr);
+		return;
+	}
+	
+	_conf_length = 0;
+	
+	// Read report descriptors of all interfaces
+	_report_intf = 0;
+	_field_count = 0;
+	
+	control_status(SOFTUSB_DEVICE_ADDRESS, su_query_report_descr);
+}
+
+void SoftUsb::start_polling()
+{
+	unsigned int keys[HID_KEY_WORDS];
+	int i;
+	
+	// Release keys held on the previous device
+	for (i = 0; i < HID_KEY_WORDS; i++)
+	{
+		keys[i] = 0;
+	}
+	
+	parse_keyboard_report(keys);
+	
+	// LEDs are off after attach
+	_leds_sent = 0;
+	_led_intf = -1;
+	
+	for (i = _interface_count - 1; i >= 0; i--)
+	{
+		if (_interfaces[i].leds)
+		{
+			_led_intf = i;
+		}
+	}
+	
+	// Boot devices have endpoint 1
+	if (_endpoint_count == 0 && _interface_count > 0)
+	{
+		_endpoints[0].descr.length = sizeof(usb_endpoint_descriptor_t);
+		_endpoints[0].descr.descr_type = 5;
+		_endpoints[0].descr.endpoint_address = 0x81;
+		_endpoints[0].descr.attributes = 3;
+		_endpoints[0].descr.max_packet_size[0] = 8;
+		_endpoints[0].descr.max_packet_size[1] = 0;
+		_endpoints[0].descr.interval = SOFTUSB_DEFAULT_INTERVAL;
+		_endpoints[0].intf = 0;
+		_endpoint_count = 1;
+	}
+	
+	for (i = 0; i < _endpoint_count; i++)
+	{
+		_endpoints[i].due = _frame;
+		_endpoints[i].interval = get_endpoint_interval(i);
+		_endpoints[i].naks = 0;
+		// SET_CONFIGURATION resets toggles to DATA0
+		_endpoints[i].toggle = 0;
+		_endpoints[i].last_length = 0xFF;
+	}
+	
+	if (_cache_store)
+	{
+		store_cached();
+		_cache_store = 0;
+	}
+	
+	set_state(su_work);
+}
+
+// Restore configuration and report plan of a known device
+int SoftUsb::load_cached()
+{
+	const softusb_cache_entry_t *entry;
+	int i;
+	
+	if (_cache == 0)
+	{
+		return 0;
+	}
+	
+	entry = _cache->find(_vendor_id, _device_id, _descriptor[13] * 256 + _descriptor[12]);
+	
+	if (entry == 0)
+	{
+		return 0;
+	}
+	
+	// Report protocol plan can't be used in boot protocol
+	for (i = 0; i < entry->interface_count; i++)
+	{
+		if (_hid_protocol == SOFTUSB_PROTOCOL_BOOT && entry->interfaces[i].descr.interface_subclass == 1 &&
+			!entry->interfaces[i].boot_layout)
+		{
+			return 0;
+		}
+	}
+	
+	for (i = 0; i < SOFTUSB_CONF_DESCR_SIZE; i++)
+	{
+		_conf_descriptor[i] = entry->conf_descriptor[i];
+	}
+	
+	_interface_count = entry->interface_count;
+	_endpoint_count = entry->endpoint_count;
+	_field_count = entry->field_count;
+	
+	for (i = 0; i < _interface_count; i++)
+	{
+		_interfaces[i] = entry->interfaces[i];
+	}
+	
+	for (i = 0; i < _endpoint_count; i++)
+	{
+		_endpoints[i] = entry->endpoints[i];
+	}
+	
+	for (i = 0; i < _field_count; i++)
+	{
+		_fields[i] = entry->fields[i];
+	}
+	
+	return 1;
+}
+
+void SoftUsb::store_cached()
+{
+	softusb_cache_entry_t *entry;
+	int i;
+	
+	entry = _cache->add(_vendor_id, _device_id, _descriptor[13] * 256 + _descriptor[12]);
+	
+	for (i = 0; i < SOFTUSB_CONF_DESCR_SIZE; i++)
+	{
+		entry->conf_descriptor[i] = _conf_descriptor[i];
+	}
+	
+	entry->interface_count = _interface_count;
+	entry->endpoint_count = _endpoint_count;
+	entry->field_count = _field_count;
+	
+	for (i = 0; i < _interface_count; i++)
+	{
+		entry->interfaces[i] = _interfaces[i];
+	}
+	
+	for (i = 0; i < _endpoint_count; i++)
+	{
+		entry->endpoints[i] = _endpoints[i];
+	}
+	
+	for (i = 0; i < _field_count; i++)
+	{
+		entry->fields[i] = _fields[i];
+	}
+}
+
+// Collect one descriptor of the configuration
+void SoftUsb::parse_conf_byte(unsigned char value)
+{
+	if (_parse_pos == 0)
+	{
+		_parse_length = value < 2 ? 2 : value;
+	}
+	
+	if (_parse_pos < sizeof(_parse_buf))
+	{
+		_parse_buf[_parse_pos] = value;
+	}
+	
+	_parse_pos++;
+	
+	if (_parse_pos >= _parse_length)
+	{
+		parse_conf_item();
+		_parse_pos = 0;
+	}
+}
+
+// Add interface or interrupt IN endpoint to the tables
+void SoftUsb::parse_conf_item()
+{
+	const usb_interface_descriptor_t *intf = (const usb_interface_descriptor_t *)_parse_buf;
+	const usb_hid_descriptor_t *hid = (const usb_hid_descriptor_t *)_parse_buf;
+	const usb_endpoint_descriptor_t *ep = (const usb_endpoint_descriptor_t *)_parse_buf;
+	softusb_interface_t *item;
+	softusb_endpoint_t *endpoint;
+	unsigned int i;
+	
+	switch (_parse_buf[1])
+	{
+		case 4:
+			if (_parse_length < sizeof(usb_interface_descriptor_t))
+			{
+				break;
+			}
+			
+			// Alternate settings and extra interfaces are ignored
+			_parse_intf = -1;
+			
+			if (intf->alternate_setting != 0 || _interface_count >= SOFTUSB_MAX_INTERFACES)
+			{
+				break;
+			}
+			
+			_parse_intf = _interface_count++;
+			item = &_interfaces[_parse_intf];
+			
+			for (i = 0; i < sizeof(usb_interface_descriptor_t); i++)
+			{
+				((unsigned char *)&item->descr)[i] = _parse_buf[i];
+			}
+			
+			item->report_length = 0;
+			item->type = USB_DEVICE_UNKNOWN;
+			item->report_ids = 0;
+			item->boot_layout = 0;
+			item->leds = 0;
+			item->led_report_id = 0;
+			
+			if (intf->interface_subclass == 1)
+			{
+				switch (intf->protocol)
+				{
+					case 1:
+						item->type = USB_DEVICE_KEYBOARD;
+						break;
+					case 2:
+						item->type = USB_DEVICE_MOUSE;
+						break;
+				}
+			}
+			break;
+		case 0x21:
+			if (_parse_intf < 0 || _parse_length < sizeof(usb_hid_descriptor_t) || hid->class_descr_type != 0x22)
+			{
+				break;
+			}
+			
+			_interfaces[_parse_intf].report_length = hid->class_descr_length[1] * 256 + hid->class_descr_length[0];
+			break;
+		case 5:
+			if (_parse_intf < 0 || _parse_length < sizeof(usb_endpoint_descriptor_t) || _endpoint_count >= SOFTUSB_MAX_ENDPOINTS)
+			{
+				break;
+			}
+			
+			if (!(ep->endpoint_address & 0x80) || (ep->attributes & 3) != 3)
+			{
+				break;
+			}
+			
+			endpoint = &_endpoints[_endpoint_count++];
+			
+			for (i = 0; i < sizeof(usb_endpoint_descriptor_t); i++)
+			{
+				((unsigned char *)&endpoint->descr)[i] = _parse_buf[i];
+			}
+			
+			endpoint->intf = _parse_intf;
+			endpoint->due = 0;
+			break;
+	}
+}
+
+void SoftUsb::process_query_report_descr()
+{
+	int res;
+	unsigned char request[8];
+	softusb_interface_t *intf;
+	int i;
+	
+	// Skip interfaces without report descriptor and boot interfaces in boot protocol
+	while (_report_intf < _interface_count &&
+		(_interfaces[_report_intf].descr.interface_class != 3 || _interfaces[_report_intf].report_length == 0 ||
+		(_hid_protocol == SOFTUSB_PROTOCOL_BOOT && _interfaces[_report_intf].descr.interface_subclass == 1)))
+	{
+		finish_report_plan();
+		_report_intf++;
+	}
+	
+	if (_report_intf >= _interface_count)
+	{
+		start_hid_requests();
+		return;
+	}
+	
+	intf = &_interfaces[_report_intf];
+	
+	for (i = 0; i < 8; i++)
+	{
+		request[i] = get_report_descriptor_request[i];
+	}
+	
+	request[4] = intf->descr.interface_number;
+	request[6] = intf->report_length & 0xFF;
+	request[7] = intf->report_length >> 8;
+	
+	res = usb_write(TRANS_SETUP, SOFTUSB_DEVICE_ADDRESS, 0, request, 8);
+	
+	if (res != HANDSHAKE_ACK)
+	{
+		_retries++;
+		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+		
+		// Use boot protocol layout
+		if (_retries > SOFTUSB_RETRIES || res == HANDSHAKE_STALL)
+		{
+			// Don't remember the layout used after errors
+			if (res != HANDSHAKE_STALL)
+			{
+				_cache_store = 0;
+			}
+			
+			finish_report_plan();
+			_report_intf++;
+			_retries = 0;
+		}
+		
+		return;
+	}
+	
+	_data_0 = 1;
+	
+	_descr_offset = 0;
+	
+	_hid.pos = 0;
+	_hid.usage_page = 0;
+	_hid.report_size = 0;
+	_hid.report_count = 0;
+	_hid.report_id = 0;
+	_hid.is_signed = 0;
+	_hid.usage_count = 0;
+	_hid.usage_min = 0;
+	_hid.application = 0;
+	_hid.id_count = 0;
+	
+	set_state(su_read_report_descr);
+}
+
+void SoftUsb::process_read_report_descr()
+{
+	int res;
+	unsigned char buf[SOFTUSB_BUFFER_SIZE];
+	int i;
+
+	res = usb_read(TRANS_IN, SOFTUSB_DEVICE_ADDRESS, 0, buf);
+
+	// Should be SYNC, PID, up to 8 bytes and CRC
+	if (res < 4 || res > 12)
+	{
+		_retries++;
+		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+		
+		// Start over with the next interface, this one will use boot protocol layout
+		if (_retries > SOFTUSB_RETRIES || res == HANDSHAKE_STALL)
+		{
+			if (res != HANDSHAKE_STALL)
+			{
+				_cache_store = 0;
+			}
+			
+			finish_report_plan();
+			_report_intf++;
+			set_state(su_query_report_descr);
+			_state_timer = stage_pause();
+		}
+		
+		return;
+	}
+	
+	res -= 4;
+	
+	for (i = 0; i < res && _descr_offset < _interfaces[_report_intf].report_length; i++)
+	{
+		parse_report_byte(buf[i]);
+		
+		_descr_offset++;
+	}
+	
+	// Short packet ends the descriptor
+	if (res == 8 && _descr_offset < _interfaces[_report_intf].report_length)
+	{
+		_data_0 = !_data_0;
+		return;
+	}
+	
+	finish_report_plan();
+	_report_intf++;
+	
+	control_status(SOFTUSB_DEVICE_ADDRESS, su_query_report_descr);
+}
+
+// Collect one item of the report descriptor
+void SoftUsb::parse_report_byte(unsigned char value)
+{
+	if (_hid.pos == 0)
+	{
+		_hid.prefix = value;
+		_hid.size = (value & 3) == 3 ? 4 : value & 3;
+		_hid.data = 0;
+	}
+	else
+	{
+		if (_hid.pos <= 4)
+		{
+			_hid.data |= (unsigned int)value << ((_hid.pos - 1) * 8);
+		}
+		
+		// Long item: size, tag and data
+		if (_hid.prefix == 0xFE && _hid.pos == 1)
+		{
+			_hid.size = value + 2;
+		}
+	}
+	
+	_hid.pos++;
+	
+	if (_hid.pos > _hid.size)
+	{
+		parse_report_item();
+		_hid.pos = 0;
+	}
+}
+
+void SoftUsb::parse_report_item()
+{
+	switch (_hid.prefix & 0xFC)
+	{
+		// Global items
+		case 0x04:
+			_hid.usage_page = _hid.data;
+			break;
+		case 0x14:
+			// Negative logical minimum means signed values
+			_hid.is_signed = _hid.size > 0 && (_hid.data & (1u << (_hid.size * 8 - 1)));
+			break;
+		case 0x74:
+			_hid.report_size = _hid.data;
+			break;
+		case 0x84:
+			_hid.report_id = _hid.data;
+			_interfaces[_report_intf].report_ids = 1;
+			break;
+		case 0x94:
+			_hid.report_count = _hid.data;
+			break;
+		
+		// Local items
+		case 0x08:
+			if (_hid.usage_count < SOFTUSB_MAX_USAGES)
+			{
+				_hid.usages[_hid.usage_count++] = _hid.data;
+			}
+			break;
+		case 0x18:
+			_hid.usage_min = _hid.data;
+			break;
+		case 0x28:
+			break;
+		
+		// Main items
+		case 0x80:
+			parse_report_input();
+			_hid.usage_count = 0;
+			_hid.usage_min = 0;
+			break;
+		case 0xA0:
+			// Application collection
+			if (_hid.data == 1)
+			{
+				_hid.application = _hid.usage_page == 1 && _hid.usage_count > 0 ? _hid.usages[0] : 0;
+			}
+			_hid.usage_count = 0;
+			_hid.usage_min = 0;
+			break;
+		case 0x90:
+			// LED output report, LEDs are expected at its start
+			if (_hid.usage_page == 0x08 && !_interfaces[_report_intf].leds)
+			{
+				_interfaces[_report_intf].leds = 1;
+				_interfaces[_report_intf].led_report_id = _hid.report_id;
+			}
+			_hid.usage_count = 0;
+			_hid.usage_min = 0;
+			break;
+		case 0xB0:
+			_hid.usage_count = 0;
+			_hid.usage_min = 0;
+			break;
+	}
+}
+
+// Add fields of Input item to the plan
+void SoftUsb::parse_report_input()
+{
+	int i, slot, usage;
+	unsigned int offset;
+	
+	// Bit offset of the item for current report ID
+	for (slot = 0; slot < _hid.id_count; slot++)
+	{
+		if (_hid.ids[slot] == _hid.report_id)
+		{
+			break;
+		}
+	}
+	
+	if (slot >= _hid.id_count)
+	{
+		if (slot >= SOFTUSB_MAX_REPORT_IDS)
+		{
+			return;
+		}
+		
+		_hid.ids[slot] = _hid.report_id;
+		_hid.bits[slot] = 0;
+		_hid.id_count++;
+	}
+	
+	offset = _hid.bits[slot];
+	_hid.bits[slot] += _hid.report_size * _hid.report_count;
+	
+	// Constant padding and wide fields
+	if ((_hid.data & 1) || _hid.report_size == 0 || _hid.report_size > 24)
+	{
+		return;
+	}
+	
+	// Joystick, gamepad and multi-axis controller axes are absolute, not mouse movement
+	if (_hid.application == 0x04 || _hid.application == 0x05 || _hid.application == 0x08)
+	{
+		return;
+	}
+	
+	usage = _hid.usage_count > 0 ? _hid.usages[0] : _hid.usage_min;
+	
+	switch (_hid.usage_page)
+	{
+		// Keyboard
+		case 7:
+			if (!(_hid.data & 2))
+			{
+				add_report_field(SOFTUSB_FIELD_KEY_ARRAY, offset, _hid.report_size, _hid.report_count, usage);
+			}
+			else if (_hid.report_size == 1)
+			{
+				add_report_field(usage >= 0xE0 ? SOFTUSB_FIELD_KEY_MODIFIERS : SOFTUSB_FIELD_KEY_BITMAP,
+					offset, 1, _hid.report_count, usage);
+			}
+			break;
+		// Buttons
+		case 9:
+			if ((_hid.data & 2) && _hid.report_size == 1)
+			{
+				add_report_field(SOFTUSB_FIELD_BUTTONS, offset, 1, _hid.report_count > 16 ? 16 : _hid.report_count, usage);
+			}
+			break;
+		// Generic desktop, only relative axes are mouse movement
+		case 1:
+			if (!(_hid.data & 2) || !(_hid.data & 4))
+			{
+				break;
+			}
+			
+			for (i = 0; i < _hid.report_count; i++)
+			{
+				// Last usage repeats for the rest of elements
+				if (_hid.usage_count > 0)
+				{
+					usage = _hid.usages[i < _hid.usage_count ? i : _hid.usage_count - 1];
+				}
+				else
+				{
+					usage = _hid.usage_min + i;
+				}
+				
+				switch (usage)
+				{
+					case 0x30:
+						add_report_field(SOFTUSB_FIELD_X, offset, _hid.report_size, 1, usage);
+						break;
+					case 0x31:
+						add_report_field(SOFTUSB_FIELD_Y, offset, _hid.report_size, 1, usage);
+						break;
+					case 0x38:
+						add_report_field(SOFTUSB_FIELD_WHEEL, offset, _hid.report_size, 1, usage);
+						break;
+				}
+				
+				offset += _hid.report_size;
+			}
+			break;
+	}
+}
+
+void SoftUsb::add_report_field(int kind, unsigned int offset, int size, int count, int usage)
+{
+	softusb_field_t *field;
+	
+	if (_field_count >= SOFTUSB_MAX_FIELDS)
+	{
+		return;
+	}
+	
+	field = &_fields[_field_count++];
+	field->intf = _report_intf;
+	field->kind = kind;
+	field->report_id = _hid.report_id;
+	field->is_signed = _hid.is_signed;
+	field->offset = offset;
+	field->size = size;
+	field->count = count;
+	field->usage = usage;
+}
+
+// Set interface type by its fields, use boot layout if nothing was found
+void SoftUsb::finish_report_plan()
+{
+	int i, type = 0;
+	int intf = _report_intf;
+	
+	for (i = 0; i < _field_count; i++)
+	{
+		if (_fields[i].intf != intf)
+		{
+			continue;
+		}
+		
+		switch (_fields[i].kind)
+		{
+			case SOFTUSB_FIELD_KEY_MODIFIERS:
+			case SOFTUSB_FIELD_KEY_ARRAY:
+			case SOFTUSB_FIELD_KEY_BITMAP:
+				type |= USB_DEVICE_KEYBOARD;
+				break;
+			default:
+				type |= USB_DEVICE_MOUSE;
+				break;
+		}
+	}
+	
+	if (type != 0)
+	{
+		_interfaces[intf].type = type;
+		return;
+	}
+	
+	// Nothing to decode, reports can be read in raw mode
+	if (_interfaces[intf].type == USB_DEVICE_UNKNOWN)
+	{
+		if (_interfaces[intf].descr.interface_class == 3)
+		{
+			_interfaces[intf].type = USB_DEVICE_HID_GENERIC;
+		}
+		
+		return;
+	}
+	
+	_hid.report_id = 0;
+	_interfaces[intf].report_ids = 0;
+	_interfaces[intf].boot_layout = 1;
+	
+	switch (_interfaces[intf].type)
+	{
+		case USB_DEVICE_KEYBOARD:
+			_hid.is_signed = 0;
+			add_report_field(SOFTUSB_FIELD_KEY_MODIFIERS, 0, 1, 8, 0xE0);
+			add_report_field(SOFTUSB_FIELD_KEY_ARRAY, 16, 8, 6, 0);
+			_interfaces[intf].leds = 1;
+			_interfaces[intf].led_report_id = 0;
+			break;
+		case USB_DEVICE_MOUSE:
+			_hid.is_signed = 0;
+			add_report_field(SOFTUSB_FIELD_BUTTONS, 0, 1, 8, 1);
+			_hid.is_signed = 1;
+			add_report_field(SOFTUSB_FIELD_X, 8, 8, 1, 0x30);
+			add_report_field(SOFTUSB_FIELD_Y, 16, 8, 1, 0x31);
+			add_report_field(SOFTUSB_FIELD_WHEEL, 24, 8, 1, 0x38);
+			break;
+	}
+}
+
+// Read bit field of a report
+static int get_bits(const unsigned char *data, int length, unsigned int offset, int size, int is_signed)
+{
+	unsigned int value = 0;
+	unsigned int pos = offset >> 3;
+	int i;
+	
+	for (i = 0; i < 4 && pos + i < (unsigned int)length; i++)
+	{
+		value |= (unsigned int)data[pos + i] << (i * 8);
+	}
+	
+	value >>= offset & 7;
+	value &= (1u << size) - 1;
+	
+	if (is_signed && (value & (1u << (size - 1))))
+	{
+		value |= ~((1u << size) - 1);
+	}
+	
+	return (int)value;
+}
+
+// Run report plan of the interface
+void SoftUsb::decode_report(int intf, const unsigned char *data, int length)
+{
+	const softusb_field_t *field;
+	unsigned int keys[HID_KEY_WORDS];
+	int i, j;
+	int id = 0;
+	unsigned int base = 0;
+	int has_keys = 0, has_mouse = 0, rollover = 0;
+	int buttons = 0, dx = 0, dy = 0, dw = 0;
+	int code;
+	
+	for (i = 0; i < HID_KEY_WORDS; i++)
+	{
+		keys[i] = 0;
+	}
+	
+	if (_interfaces[intf].report_ids)
+	{
+		if (length < 1)
+		{
+			return;
+		}
+		
+		id = data[0];
+		base = 8;
+	}
+	
+	for (i = 0; i < _field_count; i++)
+	{
+		field = &_fields[i];
+		
+		if (field->intf != intf || field->report_id != id)
+		{
+			continue;
+		}
+		
+		switch (field->kind)
+		{
+			case SOFTUSB_FIELD_BUTTONS:
+				buttons = get_bits(data, length, base + field->offset, field->count, 0);
+				has_mouse = 1;
+				break;
+			case SOFTUSB_FIELD_X:
+				dx += get_bits(data, length, base + field->offset, field->size, field->is_signed);
+				has_mouse = 1;
+				break;
+			case SOFTUSB_FIELD_Y:
+				dy += get_bits(data, length, base + field->offset, field->size, field->is_signed);
+				has_mouse = 1;
+				break;
+			case SOFTUSB_FIELD_WHEEL:
+				dw += get_bits(data, length, base + field->offset, field->size, field->is_signed);
+				has_mouse = 1;
+				break;
+			case SOFTUSB_FIELD_KEY_MODIFIERS:
+				keys[7] |= get_bits(data, length, base + field->offset, field->count > 8 ? 8 : field->count, 0) << (field->usage - 0xE0);
+				has_keys = 1;
+				break;
+			case SOFTUSB_FIELD_KEY_ARRAY:
+			case SOFTUSB_FIELD_KEY_BITMAP:
+				for (j = 0; j < field->count; j++)
+				{
+					if (field->kind == SOFTUSB_FIELD_KEY_ARRAY)
+					{
+						code = get_bits(data, length, base + field->offset + j * field->size, field->size, 0);
+						
+						if (code == 0)
+						{
+							continue;
+						}
+						
+						code += field->usage;
+						
+						// Too many keys pressed, all slots are ErrorRollOver
+						if (code == 0x01)
+						{
+							rollover = 1;
+						}
+					}
+					else
+					{
+						if (!get_bits(data, length, base + field->offset + j, 1, 0))
+						{
+							continue;
+						}
+						
+						code = field->usage + j;
+					}
+					
+					if (code < HID_KEY_WORDS * 32)
+					{
+						keys[code >> 5] |= 1u << (code & 31);
+					}
+				}
+				has_keys = 1;
+				break;
+		}
+	}
+	
+	// Keep previous keys state on rollover error
+	if (has_keys && !rollover)
+	{
+		parse_keyboard_report(keys);
+	}
+	
+	if (has_mouse)
+	{
+		parse_mouse_report(buttons, dx, dy, dw);
+	}
+}
+
+// Compare keys state with the previous one, send released and pressed keys
+void SoftUsb::parse_keyboard_report(const unsigned int *keys)
+{
+	int i;
+	unsigned int changed;
+	unsigned char code;
+	unsigned char xt;
+	
+	// Modifier keys are usages 0xE0..0xE7
+	_keyb_control = keys[7] & 0xFF;
+	
+	// Don't need right control keys
+	if (_keyb_control & 0x08) _keyb_control |= 0x01;
+	if (_keyb_control & 0x10) _keyb_control |= 0x02;
+	if (_keyb_control & 0x20) _keyb_control |= 0x04;
+	
+	for (i = 0; i < HID_KEY_WORDS; i++)
+	{
+		changed = keys[i] ^ _keys[i];
+		
+		while (changed)
+		{
+			code = i * 32 + SOFTUSB_CTZ(changed);
+			changed &= changed - 1;
+			
+			xt = code < sizeof(xt_codes) ? xt_codes[code] : 0;
+			if (xt == 0)
+			{
+				continue;
+			}
+			
+			if (keys[code >> 5] & (1u << (code & 31)))
+			{
+				// Key pressed
+				switch (code)
+				{
+					case 0x53:
+						_keyb_locks ^= KEYBOARD_LOCK_NUM;
+						break;
+					case 0x39:
+						_keyb_locks ^= KEYBOARD_LOCK_CAPS;
+						break;
+					case 0x47:
+						_keyb_locks ^= KEYBOARD_LOCK_SCROLL;
+						break;
+				}
+				
+				add_key(xt);
+			}
+			else
+			{
+				// Key released
+				add_key(xt | 0x80);
+			}
+		}
+		
+		// Save keys state
+		_keys[i] = keys[i];
+	}
+}
+
+void SoftUsb::parse_mouse_report(int buttons, int dx, int dy, int dw)
+{
+	_mouse_seq++;
+	
+	SOFTUSB_MEMORY_BARRIER;
+	
+	_mouse.buttons = buttons;
+	_mouse.x += dx;
+	_mouse.y += dy;
+	_mouse.wheel += dw;
+	_mouse.dx += dx;
+	_mouse.dy += dy;
+	_mouse.dwheel += dw;
+	
+	if (_mouse.x < MOUSE_LEFT_LIMIT) _mouse.x = MOUSE_LEFT_LIMIT;
+	if (_mouse.x > MOUSE_RIGHT_LIMIT) _mouse.x = MOUSE_RIGHT_LIMIT;
+	if (_mouse.y < MOUSE_TOP_LIMIT) _mouse.y = MOUSE_TOP_LIMIT;
+	if (_mouse.y > MOUSE_BOTTOM_LIMIT) _mouse.y = MOUSE_BOTTOM_LIMIT;
+	
+	SOFTUSB_MEMORY_BARRIER;
+	
+	_mouse_seq++;
+}
+
+int SoftUsb::is_same_report(const softusb_endpoint_t *e, const unsigned char *data, int length)
+{
+	int i;
+	
+	if (length != e->last_length)
+	{
+		return 0;
+	}
+	
+	for (i = 0; i < length; i++)
+	{
+		if (data[i] != e->last[i])
+		{
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+void SoftUsb::process_work()
+{
+	int res;
+	unsigned char buf[SOFTUSB_BUFFER_SIZE];
+	unsigned char *packet = buf;
+	unsigned char *data;
+	softusb_endpoint_t *e;
+	softusb_raw_report_t *slot;
+	int i, ep = 0;
+	
+	if (_endpoint_count == 0)
+	{
+		return;
+	}
+	
+	// Output reports don't delay a due poll
+	if (has_output_report() && !has_due_endpoint())
+	{
+		set_state(su_set_report);
+		process_set_report();
+		return;
+	}
+	
+	// Most overdue endpoint
+	for (i = 1; i < _endpoint_count; i++)
+	{
+		if ((int)(_endpoints[i].due - _endpoints[ep].due) < 0)
+		{
+			ep = i;
+		}
+	}
+	
+	e = &_endpoints[ep];
+	
+	// Raw mode receives into the slot not used by application. If it is the published
+	// one, the latest report is kept there until a new one is received
+	slot = &_raw[!_raw_reading];
+	
+	if (_raw_reports && slot != &_raw[_raw_index])
+	{
+		packet = slot->packet;
+	}
+	
+	res = usb_read_packet(TRANS_IN, SOFTUSB_DEVICE_ADDRESS, e->descr.endpoint_address & 0x0F, packet);
+	data = packet + 2;
+	
+	_poll_stats.polls++;
+
+	if (res > 0 && res <= SOFTUSB_MAX_PACKET)
+	{
+		res -= 4;
+		
+		if (_rx_pid != (e->toggle ? DATA_DATA1 : DATA_DATA0))
+		{
+			// Our ACK was lost and the device sent the report again
+			_poll_stats.duplicates++;
+		}
+		else if (_interfaces[e->intf].type == USB_DEVICE_KEYBOARD && is_same_report(e, data, res))
+		{
+			// Key state reports, nothing has changed. Mouse reports are relative
+			// and always decoded
+			e->toggle ^= 1;
+			_poll_stats.unchanged++;
+		}
+		else
+		{
+			e->toggle ^= 1;
+			
+			for (i = 0; i < 8; i++)
+			{
+				e->last[i] = data[i];
+			}
+			
+			e->last_length = res;
+			
+			if (_raw_reports)
+			{
+				publish_raw_report(slot, packet, e, res);
+			}
+			else
+			{
+				for (i = 0; i < 8; i++)
+				{
+					_report[i] = data[i];
+				}
+			}
+			
+			if (_interfaces[e->intf].type != USB_DEVICE_HID_GENERIC)
+			{
+				decode_report(e->intf, data, res);
+			}
+		}
+		
+		// Device is active, poll at full rate
+		e->interval = get_endpoint_interval(ep);
+		e->naks = 0;
+		_poll_stats.reports++;
+	}
+	else if (res == HANDSHAKE_NAK)
+	{
+		_poll_stats.naks++;
+		
+		// Device is idle, poll less often
+		if (_idle_naks > 0 && ++e->naks >= _idle_naks)
+		{
+			e->naks = 0;
+			e->interval *= 2;
+			
+			if (e->interval > _idle_max_interval)
+			{
+				e->interval = _idle_max_interval;
+			}
+			
+			if (e->interval < get_endpoint_interval(ep))
+			{
+				e->interval = get_endpoint_interval(ep);
+			}
+		}
+	}
+	else
+	{
+		_poll_stats.errors++;
+		_retries++;
+		_state_timer = SOFTUSB_PACKET_PAUSE_MS;
+		
+		if (_retries > SOFTUSB_RETRIES)
+		{
+			set_state(su_nodevice);
+		}
+		
+		return;
+	}
+	
+	e->due = _frame + e->interval;
+	
+	wait_endpoints();
+}
+
+// Make the slot the latest report
+void SoftUsb::publish_raw_report(softusb_raw_report_t *slot, const unsigned char *packet, const softusb_endpoint_t *e, int length)
+{
+	int i;
+	
+	// Packet was received into a local buffer
+	if (packet != slot->packet)
+	{
+		for (i = 0; i < length + 4; i++)
+		{
+			slot->packet[i] = packet[i];
+		}
+	}
+	
+	slot->length = length;
+	slot->intf = e->intf;
+	slot->ep = e->descr.endpoint_address;
+	slot->seq = ++_raw_seq;
+	
+	SOFTUSB_MEMORY_BARRIER;
+	
+	_raw_index = slot - _raw;
+}
+
+// Sleep until the next endpoint is due
+void SoftUsb::wait_endpoints()
+{
+	int i, wait;
+	
+	if (_endpoint_count == 0)
+	{
+		return;
+	}
+	
+	wait = _endpoints[0].due - _frame;
+	
+	for (i = 1; i < _endpoint_count; i++)
+	{
+		if ((int)(_endpoints[i].due - _frame) < wait)
+		{
+			wait = _endpoints[i].due - _frame;
+		}
+	}
+	
+	_state_timer = wait > 0 ? wait - 1 : 0;
+}
+
+// Endpoint to poll in this frame
+int SoftUsb::has_due_endpoint()
+{
+	int i;
+	
+	for (i = 0; i < _endpoint_count; i++)
+	{
+		if ((int)(_endpoints[i].due - _frame) <= 0)
+		{
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// Trace
+/////////////////////////////////////////////////////////////////////////
+
+#ifdef SOFTUSB_TRACE
+// Linux usbmon errors
+#define USBMON_EAGAIN			(-11)
+#define USBMON_EPIPE			(-32)
+#define USBMON_EILSEQ			(-84)
+#define USBMON_ETIMEDOUT		(-110)
+
+#define USBMON_HEADER_SIZE		48
+#define USBMON_LINKTYPE			189
+
+void SoftUsb::trace_begin()
+{
+	_trace_start = TIMER_1500_KHZ_VALUE;
+	_trace_ticks = 0;
+}
+
+void SoftUsb::trace(int token, int addr, int ep, int data_pid, int handshake,
+	const unsigned char *data, int length)
+{
+	softusb_trace_t *record = &_trace[_trace_head & (SOFTUSB_TRACE_SIZE - 1)];
+	int i;
+	
+	if (length < 0 || (data_pid != DATA_DATA0 && data_pid != DATA_DATA1))
+	{
+		length = 0;
+	}
+	
+	if (length > 8)
+	{
+		length = 8;
+	}
+	
+	record->frame = _frame;
+	record->ticks = _trace_ticks + ((TIMER_1500_KHZ_VALUE - _trace_start) & 0xFFFF);
+	record->token = token;
+	record->addr = addr;
+	record->ep = ep;
+	record->data_pid = data_pid;
+	record->handshake = handshake;
+	record->length = length;
+	
+	for (i = 0; i < length; i++)
+	{
+		record->data[i] = data[i];
+	}
+	
+	SOFTUSB_MEMORY_BARRIER;
+	
+	_trace_head++;
+}
+
+int SoftUsb::read_trace(softusb_trace_t *records, int max)
+{
+	unsigned int head = _trace_head;
+	unsigned int n, lost, i;
+	
+	// Skip overwritten records
+	if (head - _trace_tail > SOFTUSB_TRACE_SIZE)
+	{
+		_trace_tail = head - SOFTUSB_TRACE_SIZE;
+	}
+	
+	n = head - _trace_tail;
+	
+	if (n > (unsigned int)max)
+	{
+		n = max;
+	}
+	
+	if (n == 0)
+	{
+		return 0;
+	}
+	
+	SOFTUSB_MEMORY_BARRIER;
+	
+	for (i = 0; i < n; i++)
+	{
+		records[i] = _trace[(_trace_tail + i) & (SOFTUSB_TRACE_SIZE - 1)];
+	}
+	
+	SOFTUSB_MEMORY_BARRIER;
+	
+	// Drop records overwritten by the timer interrupt while copying
+	head = _trace_head;
+	lost = head - _trace_tail > SOFTUSB_TRACE_SIZE ? head - _trace_tail - SOFTUSB_TRACE_SIZE : 0;
+	
+	if (lost >= n)
+	{
+		_trace_tail = head - SOFTUSB_TRACE_SIZE;
+		return 0;
+	}
+	
+	for (i = lost; i < n; i++)
+	{
+		records[i - lost] = records[i];
+	}
+	
+	_trace_tail += n;
+	
+	return n - lost;
+}
+
+int SoftUsb::export_trace(int bus, softusb_write_t write, void *context)
+{
+	softusb_trace_t records[8];
+	int i, n, total = 0;
+	
+	while ((n = read_trace(records, 8)) > 0)
+	{
+		for (i = 0; i < n; i++)
+		{
+			softusb_pcap_record(&records[i], _trace_id++, bus, write, context);
+		}
+		
+		total += n;
+	}
+	
+	return total;
+}
+
+static void put16(unsigned char *p, unsigned int value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+static void put32(unsigned char *p, unsigned int value)
+{
+	put16(p, value);
+	put16(p + 2, value >> 16);
+}
+
+void softusb_pcap_header(softusb_write_t write, void *context)
+{
+	unsigned char header[24];
+	
+	put32(header, 0xA1B2C3D4);
+	put16(header + 4, 2);
+	put16(header + 6, 4);
+	put32(header + 8, 0);
+	put32(header + 12, 0);
+	put32(header + 16, 65535);
+	put32(header + 20, USBMON_LINKTYPE);
+	
+	write(context, header, sizeof(header));
+}
+
+void softusb_pcap_record(const softusb_trace_t *record, unsigned int id, int bus,
+	softusb_write_t write, void *context)
+{
+	unsigned char buf[16 + USBMON_HEADER_SIZE + 8];
+	unsigned char *mon = buf + 16;
+	int length = record->length;
+	int status = 0;
+	int i;
+	
+	for (i = 0; i < (int)sizeof(buf); i++)
+	{
+		buf[i] = 0;
+	}
+	
+	if (record->token == TOKEN_IN)
+	{
+		switch (record->data_pid)
+		{
+			case DATA_DATA0:
+			case DATA_DATA1:
+				status = record->handshake == HANDSHAKE_ACK ? 0 : USBMON_EILSEQ;
+				break;
+			case HANDSHAKE_NAK:
+				status = USBMON_EAGAIN;
+				break;
+			case HANDSHAKE_STALL:
+				status = USBMON_EPIPE;
+				break;
+			default:
+				status = USBMON_ETIMEDOUT;
+				break;
+		}
+	}
+	else
+	{
+		switch (record->handshake)
+		{
+			case HANDSHAKE_ACK:
+				status = 0;
+				break;
+			case HANDSHAKE_NAK:
+				status = USBMON_EAGAIN;
+				break;
+			case HANDSHAKE_STALL:
+				status = USBMON_EPIPE;
+				break;
+			default:
+				status = USBMON_ETIMEDOUT;
+				break;
+		}
+	}
+	
+	// SETUP data goes to the setup field of the header
+	if (record->token == TOKEN_SETUP)
+	{
+		length = 0;
+	}
+	
+	// pcap record header, frame number is the time in ms
+	put32(buf, record->frame / 1000);
+	put32(buf + 4, (record->frame % 1000) * 1000);
+	put32(buf + 8, USBMON_HEADER_SIZE + length);
+	put32(buf + 12, USBMON_HEADER_SIZE + length);
+	
+	// usbmon header
+	put32(mon, id);
+	mon[8] = record->token == TOKEN_IN ? 'C' : 'S';
+	mon[9] = record->ep == 0 ? 2 : 1;
+	mon[10] = record->ep | (record->token == TOKEN_IN ? 0x80 : 0);
+	mon[11] = record->addr;
+	put16(mon + 12, bus);
+	mon[14] = record->token == TOKEN_SETUP ? 0 : '-';
+	mon[15] = length > 0 ? 0 : (record->token == TOKEN_IN ? '>' : '<');
+	put32(mon + 16, record->frame / 1000);
+	put32(mon + 24, (record->frame % 1000) * 1000);
+	put32(mon + 28, status);
+	put32(mon + 32, record->token == TOKEN_SETUP ? 0 : length);
+	put32(mon + 36, length);
+	
+	if (record->token == TOKEN_SETUP)
+	{
+		for (i = 0; i < record->length; i++)
+		{
+			mon[40 + i] = record->data[i];
+		}
+	}
+	else
+	{
+		for (i = 0; i < length; i++)
+		{
+			mon[USBMON_HEADER_SIZE + i] = record->data[i];
+		}
+	}
+	
+	write(context, buf, 16 + USBMON_HEADER_SIZE + length);
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////
+// SoftUsbCache
+/////////////////////////////////////////////////////////////////////////
+
+#define SOFTUSB_CACHE_HEADER	8
+// Record sizes: entry without tables, one interface, endpoint and field
+#define SOFTUSB_CACHE_ENTRY		(13 + SOFTUSB_CONF_DESCR_SIZE)
+#define SOFTUSB_CACHE_INTERFACE	(sizeof(usb_interface_descriptor_t) + 7)
+#define SOFTUSB_CACHE_ENDPOINT	(sizeof(usb_endpoint_descriptor_t) + 1)
+#define SOFTUSB_CACHE_FIELD		11
+
+// Little-endian values of a blob record
+static void cache_put(unsigned char *blob, int &n, unsigned int value, int bytes)
+{
+	int i;
+	
+	for (i = 0; i < bytes; i++)
+	{
+		blob[n++] = (value >> (i * 8)) & 0xFF;
+	}
+}
+
+static unsigned int cache_get(const unsigned char *blob, int &n, int bytes)
+{
+	unsigned int value = 0;
+	int i;
+	
+	for (i = 0; i < bytes; i++)
+	{
+		value |= (unsigned int)blob[n++] << (i * 8);
+	}
+	
+	return value;
+}
+
+static int cache_record_size(int interfaces, int endpoints, int fields)
+{
+	return SOFTUSB_CACHE_ENTRY + interfaces * SOFTUSB_CACHE_INTERFACE +
+		endpoints * SOFTUSB_CACHE_ENDPOINT + fields * SOFTUSB_CACHE_FIELD;
+}
+
+// Parsed results only, endpoint poll state is set by start_polling()
+static void cache_save_entry(const softusb_cache_entry_t *entry, unsigned char *blob, int &n)
+{
+	const softusb_interface_t *intf;
+	const softusb_endpoint_t *e;
+	const softusb_field_t *f;
+	unsigned int j;
+	int i;
+	
+	cache_put(blob, n, entry->vendor_id, 2);
+	cache_put(blob, n, entry->device_id, 2);
+	cache_put(blob, n, entry->release, 2);
+	cache_put(blob, n, entry->interface_count, 1);
+	cache_put(blob, n, entry->endpoint_count, 1);
+	cache_put(blob, n, entry->field_count, 1);
+	cache_put(blob, n, entry->stamp, 4);
+	
+	for (j = 0; j < SOFTUSB_CONF_DESCR_SIZE; j++)
+	{
+		blob[n++] = entry->conf_descriptor[j];
+	}
+	
+	for (i = 0; i < entry->interface_count; i++)
+	{
+		intf = &entry->interfaces[i];
+		
+		for (j = 0; j < sizeof(usb_interface_descriptor_t); j++)
+		{
+			blob[n++] = ((const unsigned char *)&intf->descr)[j];
+		}
+		
+		cache_put(blob, n, intf->report_length, 2);
+		cache_put(blob, n, intf->type, 1);
+		cache_put(blob, n, intf->report_ids, 1);
+		cache_put(blob, n, intf->boot_layout, 1);
+		cache_put(blob, n, intf->leds, 1);
+		cache_put(blob, n, intf->led_report_id, 1);
+	}
+	
+	for (i = 0; i < entry->endpoint_count; i++)
+	{
+		e = &entry->endpoints[i];
+		
+		for (j = 0; j < sizeof(usb_endpoint_descriptor_t); j++)
+		{
+			blob[n++] = ((const unsigned char *)&e->descr)[j];
+		}
+		
+		cache_put(blob, n, e->intf, 1);
+	}
+	
+	for (i = 0; i < entry->field_count; i++)
+	{
+		f = &entry->fields[i];
+		
+		cache_put(blob, n, f->intf, 1);
+		cache_put(blob, n, f->kind, 1);
+		cache_put(blob, n, f->report_id, 1);
+		cache_put(blob, n, f->is_signed, 1);
+		cache_put(blob, n, f->offset, 2);
+		cache_put(blob, n, f->size, 1);
+		cache_put(blob, n, f->count, 2);
+		cache_put(blob, n, f->usage, 2);
+	}
+}
+
+static void cache_load_entry(softusb_cache_entry_t *entry, const unsigned char *blob, int &n)
+{
+	softusb_interface_t *intf;
+	softusb_endpoint_t *e;
+	softusb_field_t *f;
+	unsigned int j;
+	int i;
+	
+	entry->vendor_id = cache_get(blob, n, 2);
+	entry->device_id = cache_get(blob, n, 2);
+	entry->release = cache_get(blob, n, 2);
+	entry->interface_count = cache_get(blob, n, 1);
+	entry->endpoint_count = cache_get(blob, n, 1);
+	entry->field_count = cache_get(blob, n, 1);
+	entry->stamp = cache_get(blob, n, 4);
+	
+	for (j = 0; j < SOFTUSB_CONF_DESCR_SIZE; j++)
+	{
+		entry->conf_descriptor[j] = blob[n++];
+	}
+	
+	for (i = 0; i < entry->interface_count; i++)
+	{
+		intf = &entry->interfaces[i];
+		
+		for (j = 0; j < sizeof(usb_interface_descriptor_t); j++)
+		{
+			((unsigned char *)&intf->descr)[j] = blob[n++];
+		}
+		
+		intf->report_length = cache_get(blob, n, 2);
+		intf->type = cache_get(blob, n, 1);
+		intf->report_ids = cache_get(blob, n, 1);
+		intf->boot_layout = cache_get(blob, n, 1);
+		intf->leds = cache_get(blob, n, 1);
+		intf->led_report_id = cache_get(blob, n, 1);
+	}
+	
+	for (i = 0; i < entry->endpoint_count; i++)
+	{
+		e = &entry->endpoints[i];
+		
+		for (j = 0; j < sizeof(usb_endpoint_descriptor_t); j++)
+		{
+			((unsigned char *)&e->descr)[j] = blob[n++];
+		}
+		
+		e->intf = cache_get(blob, n, 1);
+	}
+	
+	for (i = 0; i < entry->field_count; i++)
+	{
+		f = &entry->fields[i];
+		
+		f->intf = cache_get(blob, n, 1);
+		f->kind = cache_get(blob, n, 1);
+		f->report_id = cache_get(blob, n, 1);
+		f->is_signed = cache_get(blob, n, 1);
+		f->offset = cache_get(blob, n, 2);
+		f->size = cache_get(blob, n, 1);
+		f->count = cache_get(blob, n, 2);
+		f->usage = cache_get(blob, n, 2);
+	}
+}
+
+SoftUsbCache::SoftUsbCache()
+{
+	clear();
+}
+
+void SoftUsbCache::clear()
+{
+	int i;
+	
+	for (i = 0; i < SOFTUSB_CACHE_SIZE; i++)
+	{
+		_entries[i].stamp = 0;
+	}
+	
+	_stamp = 0;
+}
+
+softusb_cache_entry_t *SoftUsbCache::find(unsigned short vendor_id, unsigned short device_id, unsigned short release)
+{
+	int i;
+	
+	for (i = 0; i < SOFTUSB_CACHE_SIZE; i++)
+	{
+		if (_entries[i].stamp != 0 && _entries[i].vendor_id == vendor_id &&
+			_entries[i].device_id == device_id && _entries[i].release == release)
+		{
+			_entries[i].stamp = ++_stamp;
+			return &_entries[i];
+		}
+	}
+	
+	return 0;
+}
+
+softusb_cache_entry_t *SoftUsbCache::add(unsigned short vendor_id, unsigned short device_id, unsigned short release)
+{
+	softusb_cache_entry_t *entry;
+	int i;
+	
+	entry = find(vendor_id, device_id, release);
+	
+	if (entry == 0)
+	{
+		// Free or least recently used entry
+		entry = &_entries[0];
+		
+		for (i = 1; i < SOFTUSB_CACHE_SIZE; i++)
+		{
+			if (_entries[i].stamp < entry->stamp)
+			{
+				entry = &_entries[i];
+			}
+		}
+		
+		entry->vendor_id = vendor_id;
+		entry->device_id = device_id;
+		entry->release = release;
+		entry->stamp = ++_stamp;
+	}
+	
+	return entry;
+}
+
+int SoftUsbCache::get_blob_size()
+{
+	const softusb_cache_entry_t *entry;
+	int i;
+	int n = SOFTUSB_CACHE_HEADER + 2;
+	
+	for (i = 0; i < SOFTUSB_CACHE_SIZE; i++)
+	{
+		entry = &_entries[i];
+		
+		if (entry->stamp != 0)
+		{
+			n += 2 + cache_record_size(entry->interface_count, entry->endpoint_count, entry->field_count);
+		}
+	}
+	
+	return n;
+}
+
+int SoftUsbCache::save(unsigned char *blob, int size)
+{
+	const softusb_cache_entry_t *entry;
+	unsigned short crc;
+	int i;
+	int count = 0;
+	int n = SOFTUSB_CACHE_HEADER;
+	
+	if (size < get_blob_size())
+	{
+		return 0;
+	}
+	
+	for (i = 0; i < SOFTUSB_CACHE_SIZE; i++)
+	{
+		entry = &_entries[i];
+		
+		if (entry->stamp == 0)
+		{
+			continue;
+		}
+		
+		cache_put(blob, n, cache_record_size(entry->interface_count, entry->endpoint_count, entry->field_count), 2);
+		cache_save_entry(entry, blob, n);
+		count++;
+	}
+	
+	blob[0] = 'S';
+	blob[1] = 'U';
+	blob[2] = 'C';
+	blob[3] = SOFTUSB_CACHE_VERSION;
+	blob[4] = count;
+	blob[5] = 0;
+	blob[6] = 0;
+	blob[7] = 0;
+	
+	crc = softusb_crc16(blob, n);
+	blob[n++] = crc & 0xFF;
+	blob[n++] = crc >> 8;
+	
+	return n;
+}
+
+int SoftUsbCache::load(const unsigned char *blob, int size)
+{
+	int count;
+	int record;
+	int i;
+	int n = SOFTUSB_CACHE_HEADER;
+	
+	if (size < SOFTUSB_CACHE_HEADER + 2 ||
+		blob[0] != 'S' || blob[1] != 'U' || blob[2] != 'C' || blob[3] != SOFTUSB_CACHE_VERSION)
+	{
+		return -1;
+	}
+	
+	count = blob[4];
+	
+	if (count > SOFTUSB_CACHE_SIZE)
+	{
+		return -1;
+	}
+	
+	// Record sizes must match the table sizes, tables must fit the entry
+	for (i = 0; i < count; i++)
+	{
+		if (n + 2 + SOFTUSB_CACHE_ENTRY + 2 > size)
+		{
+			return -1;
+		}
+		
+		record = blob[n] + blob[n + 1] * 256;
+		
+		// Counts follow VID, PID and bcdDevice
+		if (blob[n + 8] > SOFTUSB_MAX_INTERFACES || blob[n + 9] > SOFTUSB_MAX_ENDPOINTS ||
+			blob[n + 10] > SOFTUSB_MAX_FIELDS || record != cache_record_size(blob[n + 8], blob[n + 9], blob[n + 10]))
+		{
+			return -1;
+		}
+		
+		n += 2 + record;
+	}
+	
+	if (n + 2 > size || softusb_crc16(blob, n) != blob[n] + blob[n + 1] * 256)
+	{
+		return -1;
+	}
+	
+	clear();
+	
+	n = SOFTUSB_CACHE_HEADER;
+	
+	for (i = 0; i < count; i++)
+	{
+		// Record size
+		n += 2;
+		
+		cache_load_entry(&_entries[i], blob, n);
+		
+		if (_entries[i].stamp > _stamp)
+		{
+			_stamp = _entries[i].stamp;
+		}
+	}
+	
+	return count;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// SoftUsbHost
+/////////////////////////////////////////////////////////////////////////
+
+SoftUsbHost::SoftUsbHost(unsigned int budget)
+{
+	_count = 0;
+	_budget = budget;
+}
+
+int SoftUsbHost::add_port(SoftUsb *port)
+{
+	if (_count >= SOFTUSB_HOST_MAX_PORTS)
+	{
+		return 0;
+	}
+	
+	_ports[_count] = port;
+	_waiting[_count] = 0;
+	_count++;
+	
+	return 1;
+}
+
+void SoftUsbHost::set_budget(unsigned int budget)
+{
+	_budget = budget;
+}
+
+void SoftUsbHost::timer1ms()
+{
+	unsigned char pending[SOFTUSB_HOST_MAX_PORTS];
+	unsigned char allow[SOFTUSB_HOST_MAX_PORTS];
+	unsigned int budget = _budget;
+	unsigned int spent;
+	int i, best;
+	int granted = 0;
+	
+	for (i = 0; i < _count; i++)
+	{
+		pending[i] = _ports[i]->has_pending_work();
+		allow[i] = 0;
+	}
+	
+	// Give transactions to ports that wait longest, at least one per frame
+	while (granted == 0 || budget >= SOFTUSB_TRANSACTION_TICKS)
+	{
+		best = -1;
+		
+		for (i = 0; i < _count; i++)
+		{
+			if (pending[i] && !allow[i] && (best < 0 || _waiting[i] > _waiting[best]))
+			{
+				best = i;
+			}
+		}
+		
+		if (best < 0)
+		{
+			break;
+		}
+		
+		allow[best] = 1;
+		granted++;
+		budget = budget > SOFTUSB_TRANSACTION_TICKS ? budget - SOFTUSB_TRANSACTION_TICKS : 0;
+	}
+	
+	// Every port gets its keepalive, the budget left after granted transactions
+	// goes to control transfer stages of ports in turn
+	for (i = 0; i < _count; i++)
+	{
+		if (allow[i])
+		{
+			_ports[i]->set_control_budget(SOFTUSB_TRANSACTION_TICKS + budget);
+		}
+		
+		_ports[i]->timer1ms(allow[i]);
+		
+		if (allow[i])
+		{
+			spent = _ports[i]->get_frame_ticks();
+			spent = spent > SOFTUSB_TRANSACTION_TICKS ? spent - SOFTUSB_TRANSACTION_TICKS : 0;
+			budget = budget > spent ? budget - spent : 0;
+		}
+		
+		if (allow[i] || !pending[i])
+		{
+			_waiting[i] = 0;
+		}
+		else
+		{
+			_waiting[i]++;
+		}
+	}
 }
@@ -1,11 +1,18 @@
 #pragma once
 
+#include <atomic>
+
 /////////////////////////////////////////////////////////////////////////
 // Platform macros
 /////////////////////////////////////////////////////////////////////////
 
+#ifdef SOFTUSB_PLATFORM_HOST
+// Simulated bus and device for host builds
+#include "platform_host.h"
+#else
 // STM32F4XX
 #include "platform_stm32f4.h"
+#endif
 
 /////////////////////////////////////////////////////////////////////////
 // Consts
@@ -14,22 +21,114 @@
 #define USB_DEVICE_NOT_CONNECTED		0
 #define USB_DEVICE_KEYBOARD				1
 #define USB_DEVICE_MOUSE				2
+// Keyboard and mouse on one port (wireless dongles)
+#define USB_DEVICE_COMPOSITE			3
+// HID device without keyboard and mouse reports (gamepads, joysticks, pedals),
+// see get_raw_report()
+#define USB_DEVICE_HID_GENERIC			4
 #define USB_DEVICE_FULLSPEED			254
 #define USB_DEVICE_UNKNOWN				255
 
-#define HID_MAX_PRESSED_KEYS			3
+// Key state bitmap, one bit per HID keyboard usage
+#define HID_KEY_WORDS					8
 
+// Should be a power of 2
 #define KEYBOARD_BUFFER_SIZE			32
 
 #define KEYBOARD_CONTROL_CTRL			1
 #define KEYBOARD_CONTROL_SHIFT			2
 #define KEYBOARD_CONTROL_ALT			4
 
+// Lock keys, bits of the keyboard LED output report
+#define KEYBOARD_LOCK_NUM				1
+#define KEYBOARD_LOCK_CAPS				2
+#define KEYBOARD_LOCK_SCROLL			4
+
 #define MOUSE_LEFT_LIMIT				0
 #define MOUSE_TOP_LIMIT					0
 #define MOUSE_RIGHT_LIMIT				639
 #define MOUSE_BOTTOM_LIMIT				479
 
+// Configuration descriptor header, the rest is parsed on the fly
+#define SOFTUSB_CONF_DESCR_SIZE			9
+
+// Interfaces and interrupt IN endpoints kept after parsing
+#define SOFTUSB_MAX_INTERFACES			4
+#define SOFTUSB_MAX_ENDPOINTS			4
+
+// Report fields of all interfaces and report IDs of one interface
+#define SOFTUSB_MAX_FIELDS				16
+#define SOFTUSB_MAX_REPORT_IDS			4
+#define SOFTUSB_MAX_USAGES				4
+
+// Report field kinds
+#define SOFTUSB_FIELD_BUTTONS			1
+#define SOFTUSB_FIELD_X					2
+#define SOFTUSB_FIELD_Y					3
+#define SOFTUSB_FIELD_WHEEL				4
+#define SOFTUSB_FIELD_KEY_MODIFIERS		5
+#define SOFTUSB_FIELD_KEY_ARRAY			6
+#define SOFTUSB_FIELD_KEY_BITMAP		7
+
+// Poll interval if endpoint descriptor is not found, ms
+#define SOFTUSB_DEFAULT_INTERVAL		10
+
+// Idle backoff: poll interval is doubled after this number of NAKs in a row
+// up to the ceiling, ms
+#define SOFTUSB_IDLE_NAKS				16
+#define SOFTUSB_IDLE_MAX_INTERVAL		32
+
+// Fast enumeration timing, ms: attach debounce with the line checked every 1 ms,
+// reset recovery and SET_ADDRESS recovery (USB 2.0 spec 7.1.7.3, 7.1.7.5, 9.2.6.3)
+#define SOFTUSB_FAST_DEBOUNCE_MS		100
+#define SOFTUSB_RESET_RECOVERY_MS		10
+#define SOFTUSB_ADDRESS_RECOVERY_MS		2
+
+// Longest low-speed packet: SYNC, PID, 8 data bytes and CRC16
+#define SOFTUSB_MAX_PACKET				12
+// Output words of a packet: bits, stuffed bits and EOP
+#define SOFTUSB_WAVE_SIZE				(SOFTUSB_MAX_PACKET * 8 * 7 / 6 + 4)
+
+// Line levels returned by read_line()
+#define SOFTUSB_LINE_DM					1
+#define SOFTUSB_LINE_DP					2
+
+// Device models in SoftUsbCache
+#define SOFTUSB_CACHE_SIZE				4
+// Should be changed with the blob record format
+#define SOFTUSB_CACHE_VERSION			8
+
+// HID protocol of boot interfaces, see set_hid_protocol()
+#define SOFTUSB_PROTOCOL_AUTO			0
+#define SOFTUSB_PROTOCOL_BOOT			1
+#define SOFTUSB_PROTOCOL_REPORT			2
+
+// SET_IDLE rate of keyboards, 4 ms units (0 - report only on change)
+#define SOFTUSB_DEFAULT_IDLE_RATE		0
+
+#define SOFTUSB_HOST_MAX_PORTS			8
+
+// Estimated time of one transaction in 1.5 MHz timer ticks
+#define SOFTUSB_TRANSACTION_TICKS		150
+
+// Default time for transactions in every 1 ms frame
+#define SOFTUSB_FRAME_BUDGET_TICKS		300
+
+// Control transfer stages in one frame without set_control_budget(),
+// leaves time before the next 1 ms timer call
+#define SOFTUSB_CONTROL_FRAME_TICKS		1200
+
+// Log2 histogram of timer1ms() cost, see SOFTUSB_STATS
+#define SOFTUSB_STATS_BUCKETS			24
+
+// Transaction trace records, should be a power of 2 (see SOFTUSB_TRACE)
+#define SOFTUSB_TRACE_SIZE				64
+
+// What timer1ms() has done
+#define SOFTUSB_TICK_IDLE				0
+#define SOFTUSB_TICK_KEEPALIVE			1
+#define SOFTUSB_TICK_TRANSACTION		2
+
 /////////////////////////////////////////////////////////////////////////
 // USB descriptors
 /////////////////////////////////////////////////////////////////////////
@@ -80,36 +179,372 @@ typedef struct
 	unsigned char interface_str_index;
 } usb_interface_descriptor_t;
 
+// Endpoint descriptor
+typedef struct
+{
+	unsigned char length;
+	unsigned char descr_type;
+	unsigned char endpoint_address;
+	unsigned char attributes;
+	unsigned char max_packet_size[2];
+	unsigned char interval;
+} usb_endpoint_descriptor_t;
+
+// HID descriptor (one class descriptor)
+typedef struct
+{
+	unsigned char length;
+	unsigned char descr_type;
+	unsigned char hid_spec[2];
+	unsigned char country_code;
+	unsigned char num_descriptors;
+	unsigned char class_descr_type;
+	unsigned char class_descr_length[2];
+} usb_hid_descriptor_t;
+
+/////////////////////////////////////////////////////////////////////////
+// Parsed configuration
+/////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+	usb_interface_descriptor_t descr;
+	// Report descriptor length from HID descriptor
+	unsigned short report_length;
+	// USB_DEVICE_KEYBOARD, USB_DEVICE_MOUSE, USB_DEVICE_COMPOSITE or USB_DEVICE_UNKNOWN
+	unsigned char type;
+	// Reports start with report ID
+	unsigned char report_ids;
+	// Decoded with boot protocol layout
+	unsigned char boot_layout;
+	// Has LED output report, its report ID
+	unsigned char leds;
+	unsigned char led_report_id;
+} softusb_interface_t;
+
+typedef struct
+{
+	usb_endpoint_descriptor_t descr;
+	// Index in the interface table
+	unsigned char intf;
+	// Frame of the next poll
+	unsigned int due;
+	// Current poll interval, longer while the device is idle
+	unsigned short interval;
+	// NAKs in a row
+	unsigned char naks;
+	// Expected DATA PID: 0 - DATA0, 1 - DATA1
+	unsigned char toggle;
+	// Last decoded report
+	unsigned char last_length;
+	unsigned char last[8];
+} softusb_endpoint_t;
+
+// Interrupt endpoint poll counters
+typedef struct
+{
+	unsigned int polls;
+	unsigned int reports;
+	unsigned int naks;
+	unsigned int errors;
+	// Retransmitted reports with a wrong DATA PID, dropped
+	unsigned int duplicates;
+	// Keyboard reports equal to the previous one, not decoded
+	unsigned int unchanged;
+} softusb_poll_stats_t;
+
+// Report received in raw mode, see get_raw_report()
+typedef struct
+{
+	// SYNC, PID, up to 8 bytes of report and CRC16 as received,
+	// report starts at packet[2]
+	unsigned char packet[12];
+	unsigned char length;
+	unsigned char intf;
+	unsigned char ep;
+	// Number of the report since set_raw_reports()
+	unsigned int seq;
+} softusb_raw_report_t;
+
+// Field extraction step of the report plan
+typedef struct
+{
+	unsigned char intf;
+	unsigned char kind;
+	unsigned char report_id;
+	unsigned char is_signed;
+	// Offset in bits after report ID
+	unsigned short offset;
+	// Size of one element in bits
+	unsigned char size;
+	// Number of elements (bits of a bitmap)
+	unsigned short count;
+	// Usage of the first element
+	unsigned short usage;
+} softusb_field_t;
+
+// Mouse state
+typedef struct
+{
+	// Position within MOUSE_*_LIMIT
+	int x;
+	int y;
+	int buttons;
+	int wheel;
+	// Movement since connection, wraps around: (int)(b.dx - a.dx) is
+	// the movement between two copies
+	unsigned int dx;
+	unsigned int dy;
+	unsigned int dwheel;
+} softusb_mouse_state_t;
+
+// HID report descriptor parser state
+typedef struct
+{
+	// Current item
+	unsigned char prefix;
+	unsigned char pos;
+	unsigned char size;
+	unsigned int data;
+	
+	// Global items
+	unsigned short usage_page;
+	unsigned char report_size;
+	unsigned short report_count;
+	unsigned char report_id;
+	unsigned char is_signed;
+	
+	// Local items
+	unsigned short usages[SOFTUSB_MAX_USAGES];
+	unsigned char usage_count;
+	unsigned short usage_min;
+	
+	// Generic desktop usage of the application collection
+	unsigned short application;
+	
+	// Input report sizes in bits by report ID
+	unsigned char ids[SOFTUSB_MAX_REPORT_IDS];
+	unsigned short bits[SOFTUSB_MAX_REPORT_IDS];
+	unsigned char id_count;
+} softusb_hid_parser_t;
+
+
+/////////////////////////////////////////////////////////////////////////
+// Enumeration cache
+/////////////////////////////////////////////////////////////////////////
+
+// Parsed configuration and report plan of one device model
+typedef struct
+{
+	unsigned short vendor_id;
+	unsigned short device_id;
+	// bcdDevice
+	unsigned short release;
+	unsigned char interface_count;
+	unsigned char endpoint_count;
+	unsigned char field_count;
+	unsigned char conf_descriptor[SOFTUSB_CONF_DESCR_SIZE];
+	// Last use, 0 - free entry
+	unsigned int stamp;
+	softusb_interface_t interfaces[SOFTUSB_MAX_INTERFACES];
+	softusb_endpoint_t endpoints[SOFTUSB_MAX_ENDPOINTS];
+	softusb_field_t fields[SOFTUSB_MAX_FIELDS];
+} softusb_cache_entry_t;
+
+// Enumeration results of known devices, can be shared by several ports
+// and saved to flash between boots
+class SoftUsbCache
+{
+public:
+	SoftUsbCache();
+	
+	void clear();
+	
+	// Entry of the device model or 0
+	softusb_cache_entry_t *find(unsigned short vendor_id, unsigned short device_id, unsigned short release);
+	
+	// Entry for a new result, replaces the least recently used one
+	softusb_cache_entry_t *add(unsigned short vendor_id, unsigned short device_id, unsigned short release);
+	
+	// Blob: "SUC", version, number of entries, entries with their sizes and CRC16.
+	// Entries are written field by field in little-endian order
+	int get_blob_size();
+	// Returns blob size or 0 if size is too small
+	int save(unsigned char *blob, int size);
+	// Returns number of entries or -1 if blob is not valid
+	int load(const unsigned char *blob, int size);
+
+private:
+	softusb_cache_entry_t _entries[SOFTUSB_CACHE_SIZE];
+	unsigned int _stamp;
+};
 
 /////////////////////////////////////////////////////////////////////////
 // SoftUsb
 /////////////////////////////////////////////////////////////////////////
 
+// USB CRC16
+unsigned short softusb_crc16(const unsigned char *data, int count);
+
+// Sampled value of GPIO input register
+typedef unsigned short softusb_sample_t;
+
+// Packet decoder for sampled line (see SOFTUSB_DMA_RX)
+int softusb_decode(const softusb_sample_t *samples, int count, unsigned int period,
+	unsigned int mmask, unsigned int pmask, unsigned char *buffer, int n);
+
 enum SoftUsbState
 {
 	su_nodevice, su_fullspeed, su_debounce, su_reset, su_connected,
 	su_read_descr, su_set_address, su_wait_address,
 	su_query_conf_descr, su_read_conf_descr,
-	su_set_conf, su_wait_conf, su_work
+	su_set_conf, su_wait_conf,
+	su_query_report_descr, su_read_report_descr, su_control_status,
+	su_set_hid, su_wait_hid, su_set_report, su_report_data, su_report_status, su_work
 };
 
-// Circular buffer
-class KeyboardBuffer
+#define SOFTUSB_STATES					(su_work + 1)
+
+#ifdef SOFTUSB_STATS
+// Cost of timer1ms() calls made in one state, SOFTUSB_CYCLES units
+typedef struct
+{
+	unsigned int calls;
+	unsigned int min;
+	unsigned int max;
+	unsigned long long total;
+	// Calls with cost in [2^i, 2^(i+1)), last bucket takes the rest
+	unsigned int histogram[SOFTUSB_STATS_BUCKETS];
+} softusb_state_stats_t;
+
+typedef struct
+{
+	softusb_state_stats_t states[SOFTUSB_STATES];
+	// No packets sent (waiting, line checks and reset)
+	unsigned int idle_ticks;
+	// Only keepalive EOP sent
+	unsigned int keepalive_ticks;
+	// Keepalive and transaction
+	unsigned int transaction_ticks;
+} softusb_stats_t;
+#endif
+
+#ifdef SOFTUSB_TRACE
+// One transaction
+typedef struct
+{
+	// 1 ms frame number
+	unsigned int frame;
+	// Duration in 1.5 MHz ticks
+	unsigned short ticks;
+	// Token PID, address and endpoint
+	unsigned char token;
+	unsigned char addr;
+	unsigned char ep;
+	// DATA PID sent (SETUP, OUT) or any PID received (IN), 0 if none
+	unsigned char data_pid;
+	// Handshake PID received (SETUP, OUT) or sent (IN), 0 if none
+	unsigned char handshake;
+	unsigned char length;
+	unsigned char data[8];
+} softusb_trace_t;
+
+// Output for trace export
+typedef void (*softusb_write_t)(void *context, const void *data, int size);
+
+// Linux usbmon pcap file (Wireshark link type 189)
+void softusb_pcap_header(softusb_write_t write, void *context);
+void softusb_pcap_record(const softusb_trace_t *record, unsigned int id, int bus,
+	softusb_write_t write, void *context);
+#endif
+
+// Single-producer single-consumer ring buffer
+// Timer interrupt writes and main loop reads without disabling interrupts
+template <typename T, unsigned int SIZE>
+class SoftUsbRing
 {
+	static_assert((SIZE & (SIZE - 1)) == 0, "Ring size should be a power of 2");
+
 public:
-	KeyboardBuffer();
+	SoftUsbRing()
+	{
+		_head = 0;
+		_tail = 0;
+	}
+
+	// Producer. New items are dropped if the ring is full
+	int add(const T &item)
+	{
+		unsigned int head = _head.load(std::memory_order_relaxed);
+		
+		// Consumer has finished reading the slots before the tail
+		if (head - _tail.load(std::memory_order_acquire) >= SIZE)
+		{
+			return 0;
+		}
+		
+		_buffer[head & (SIZE - 1)] = item;
+		
+		// Item is visible before the new head
+		_head.store(head + 1, std::memory_order_release);
+		
+		return 1;
+	}
 
-	void add(unsigned char code);
-	int get();
-	int is_empty();
+	// Consumer. Returns 0 if the ring is empty
+	int get(T &item)
+	{
+		unsigned int tail = _tail.load(std::memory_order_relaxed);
+		
+		if (_head.load(std::memory_order_acquire) == tail)
+		{
+			return 0;
+		}
+		
+		item = _buffer[tail & (SIZE - 1)];
+		
+		// Slot is read before the producer may reuse it
+		_tail.store(tail + 1, std::memory_order_release);
+		
+		return 1;
+	}
+
+	// Consumer. Reads up to max items, returns number of items read
+	int read(T *items, int max)
+	{
+		unsigned int tail = _tail.load(std::memory_order_relaxed);
+		unsigned int n = _head.load(std::memory_order_acquire) - tail;
+		unsigned int i;
+		
+		if (n > (unsigned int)max)
+		{
+			n = max;
+		}
+		
+		for (i = 0; i < n; i++)
+		{
+			items[i] = _buffer[(tail + i) & (SIZE - 1)];
+		}
+		
+		_tail.store(tail + n, std::memory_order_release);
+		
+		return n;
+	}
+
+	int is_empty()
+	{
+		return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_relaxed);
+	}
 
 private:
-	unsigned char _buffer[KEYBOARD_BUFFER_SIZE];
-	int _rp;
-	int _wp;
-	int _n;
+	T _buffer[SIZE];
+	// Free-running counters, written by one side each
+	std::atomic<unsigned int> _head;
+	std::atomic<unsigned int> _tail;
 };
 
+typedef SoftUsbRing<unsigned char, KEYBOARD_BUFFER_SIZE> KeyboardBuffer;
+
 class SoftUsb
 {
 public:
@@ -117,13 +552,74 @@ public:
 	
 	// State machine timer should be called every 1 ms
 	void timer1ms(int allow_long_work = 1);
+	
+	// Next timer1ms() call will make a transaction if allowed
+	int has_pending_work();
+
+#ifdef SOFTUSB_STATS
+	// timer1ms() cost by state
+	const softusb_stats_t *get_stats();
+	void reset_stats();
+#endif
+
+#ifdef SOFTUSB_TRACE
+	// Copy up to max oldest unread records, returns number of records.
+	// Oldest records are overwritten if not read in time
+	int read_trace(softusb_trace_t *records, int max);
+	
+	// Write unread records as pcap records of the bus
+	int export_trace(int bus, softusb_write_t write, void *context);
+#endif
 
 	// Low-level information
 	SoftUsbState get_state();
 	const usb_device_descriptor_t *get_device_descriptor();
 	const usb_configuration_descriptor_t *get_conf_descriptor();
-	const usb_interface_descriptor_t *get_interface_descriptor();
+	const usb_interface_descriptor_t *get_interface_descriptor(int index = 0);
+	const usb_endpoint_descriptor_t *get_endpoint_descriptor(int index = 0);
+	int get_interface_count();
+	int get_endpoint_count();
+	int get_interface_type(int index);
+	const softusb_field_t *get_report_field(int index);
+	int get_report_field_count();
 	const unsigned char *get_device_report();
+	
+	// Raw mode: reports of all interfaces are received into one of two slots,
+	// the latest one is published without copying (get_device_report() is not updated)
+	void set_raw_reports(int enable);
+	// Latest report, doesn't change until the next call (length 0 - no reports yet)
+	const softusb_raw_report_t *get_raw_report();
+
+	// Interrupt endpoint poll interval, ms (0 - use endpoint descriptor)
+	void set_poll_interval(int interval);
+	int get_poll_interval();
+
+	// Idle backoff: poll interval grows after "naks" NAKs in a row up to "max_interval" ms
+	// and returns to the endpoint interval with the next report (0 naks - disabled)
+	void set_idle_backoff(int naks, int max_interval);
+	const softusb_poll_stats_t *get_poll_stats();
+	void reset_poll_stats();
+
+	// Fast enumeration: short debounce with a stable line check, spec minimum
+	// recovery times and no pauses between stages that were ACKed
+	void set_fast_enumeration(int enable);
+	int get_fast_enumeration();
+
+	// Time for stages of a control transfer in one frame, 1.5 MHz ticks,
+	// the rest follows in next frames (0 - as much as fits in the frame).
+	// SoftUsbHost overwrites it every frame with the budget it has left
+	void set_control_budget(unsigned int budget);
+
+	// Estimated time of transactions in the last timer1ms() call, 1.5 MHz ticks
+	unsigned int get_frame_ticks();
+
+	// Known devices skip configuration and report descriptors (0 - no cache)
+	void set_cache(SoftUsbCache *cache);
+
+	// HID requests sent after report descriptors: SET_PROTOCOL to boot interfaces
+	// (SOFTUSB_PROTOCOL_AUTO, _BOOT or _REPORT) and SET_IDLE to keyboards (4 ms units)
+	void set_hid_protocol(int protocol);
+	void set_idle_rate(int rate);
 
 	// Connection status and identification
 	int is_connected();
@@ -136,10 +632,24 @@ public:
 	int kbhit();
 	int get_key_code();
 	
+	// Read up to max key codes, returns number of codes read
+	int read_key_codes(unsigned char *codes, int max);
+	
+	// Num, Caps and Scroll Lock state (KEYBOARD_LOCK_*), toggled by the keys.
+	// Keyboard LEDs are updated in free frames, set_lock_state() doesn't wait
+	int get_lock_state();
+	void set_lock_state(int locks);
+	
 	// Mouse
 	void get_mouse_pos(int &x, int &y, int &buttons, int &wheel);
+	
+	// Consistent copy of the mouse state, interrupts are not disabled
+	void get_mouse_state(softusb_mouse_state_t &state);
+	
+	// Movement since the previous call
+	void consume_mouse_deltas(int &dx, int &dy, int &dwheel, int &buttons);
 
-private:
+protected:
 	SoftUsbState _state;
 	unsigned int _port;
 	unsigned int _mpin;
@@ -151,10 +661,58 @@ private:
 	unsigned int _state_timer;
 	unsigned int _retries;
 	unsigned char _descriptor[18];
-	unsigned char _conf_descriptor[18];
+	unsigned char _conf_descriptor[SOFTUSB_CONF_DESCR_SIZE];
 	unsigned char _report[8];
+	
+	// Raw mode slots, published slot and slot used by application
+	unsigned char _raw_reports;
+	softusb_raw_report_t _raw[2];
+	volatile int _raw_index;
+	volatile int _raw_reading;
+	unsigned int _raw_seq;
 	unsigned int _descr_offset;
 	int _data_0;
+	unsigned int _frame;
+	unsigned char _poll_interval;
+	unsigned char _fast_enum;
+	unsigned char _idle_naks;
+	unsigned short _idle_max_interval;
+	softusb_poll_stats_t _poll_stats;
+
+	// Enumeration cache, store results of this enumeration
+	SoftUsbCache *_cache;
+	unsigned char _cache_store;
+
+	// Control transfers
+	unsigned short _control_budget;
+	unsigned short _frame_ticks;
+	unsigned char _status_addr;
+	SoftUsbState _status_next;
+
+	// HID class requests
+	unsigned char _hid_protocol;
+	unsigned char _idle_rate;
+	int _hid_intf;
+	int _hid_step;
+
+	// Configuration descriptor parser
+	unsigned int _conf_length;
+	unsigned char _parse_buf[9];
+	unsigned char _parse_pos;
+	unsigned char _parse_length;
+	signed char _parse_intf;
+	softusb_interface_t _interfaces[SOFTUSB_MAX_INTERFACES];
+	softusb_endpoint_t _endpoints[SOFTUSB_MAX_ENDPOINTS];
+	int _interface_count;
+	int _endpoint_count;
+
+	// Report descriptor parser and report plan
+	int _report_intf;
+	softusb_hid_parser_t _hid;
+	softusb_field_t _fields[SOFTUSB_MAX_FIELDS];
+	int _field_count;
+	unsigned short _rx_crc;
+	unsigned char _rx_pid;
 
 	unsigned short _vendor_id;
 	unsigned short _device_id;
@@ -162,36 +720,91 @@ private:
 	unsigned char _device_subclass;
 
 	// HID data
-	unsigned char _keys_pressed[HID_MAX_PRESSED_KEYS];
-	unsigned char _keys_pressed_prev[HID_MAX_PRESSED_KEYS];
+	unsigned int _keys[HID_KEY_WORDS];
 	unsigned char _keyb_control;
+	// Written by application and timer interrupt, LED state sent to the keyboard
+	volatile unsigned char _keyb_locks;
+	unsigned char _leds_sent;
+	unsigned char _leds_value;
+	int _led_intf;
 	KeyboardBuffer _keyb_buffer;
 	KeyboardBuffer _keyb_chars_buffer;
-	int _mouse_x;
-	int _mouse_y;
-	int _mouse_b;
-	int _mouse_wheel;
+	// Written by timer interrupt, odd sequence while update is in progress
+	softusb_mouse_state_t _mouse;
+	volatile unsigned int _mouse_seq;
+	// Totals at the last consume_mouse_deltas()
+	unsigned int _mouse_consumed_dx;
+	unsigned int _mouse_consumed_dy;
+	unsigned int _mouse_consumed_dwheel;
+
+#ifdef SOFTUSB_DMA_TX
+	// Output words read by DMA, not on the stack (see platform_stm32f4.h)
+	unsigned int _wave[SOFTUSB_WAVE_SIZE];
+#endif
+
+#ifdef SOFTUSB_DMA_RX
+	// Line samples written by DMA, not on the stack (see platform_stm32f4.h)
+	softusb_sample_t _samples[SOFTUSB_DMA_RX_SAMPLES];
+#endif
+
+#ifdef SOFTUSB_STATS
+	softusb_stats_t _stats;
+#endif
+
+#ifdef SOFTUSB_TRACE
+	softusb_trace_t _trace[SOFTUSB_TRACE_SIZE];
+	volatile unsigned int _trace_head;
+	unsigned int _trace_tail;
+	unsigned int _trace_id;
+	// Timer value at the start of transaction and ticks counted before
+	// the timer was restarted by receive()
+	unsigned int _trace_start;
+	unsigned int _trace_ticks;
+	
+	void trace_begin();
+	void trace(int token, int addr, int ep, int data_pid, int handshake,
+		const unsigned char *data, int length);
+#endif
 
 	SOFTUSB_PLATFORM_PRIVATE;
 
 	// CRC calculation
 	int token_data(int addr, int ep);
-	unsigned short crc16(const unsigned char *data, int count);
 	
-	// Low-level
+	// CRC16 (poly 0x8005, reflected) of one nibble
+	static const unsigned short _crc16_table[16];
+	friend unsigned short softusb_crc16(const unsigned char *data, int count);
+	
+	// Low-level, line level functions are overridden by SoftUsbT
 	void wait(int n);
-	void eop();
-	void keepalive();
-	void send(unsigned char *data, int count);
+	virtual void line_output();
+	virtual void line_input();
+	virtual int read_line();
+	virtual void line_reset();
+	virtual void line_idle();
+	virtual void eop();
+	virtual int keepalive();
+	virtual int encode(const unsigned char *data, int count, unsigned int *wave);
+	virtual void transmit(const unsigned int *wave, int count);
+	void send(const unsigned char *data, int count);
 	void send_token(int pid, int addr, int ep);
-	int receive(unsigned char *buffer, int n);
+	virtual int receive(unsigned char *buffer, int n);
 
 	// Transport
 	int usb_write(int trans_type, int addr, int ep, const unsigned char *data, int count);
+	int usb_write_packet(int trans_type, int addr, int ep, const unsigned char *packet, int size);
 	int usb_read(int trans_type, int addr, int ep, unsigned char *buffer);
+	int usb_read_packet(int trans_type, int addr, int ep, unsigned char *buf);
 
 	// State machine
+	int frame(int allow_long_work);
 	void set_state(SoftUsbState newstate);
+	unsigned int stage_pause();
+	int is_control_stage();
+	int is_work_state();
+	int has_control_time(unsigned int spent);
+	void control_status(int addr, SoftUsbState next);
+	void process_control_status();
 	void process_nodevice();
 	void process_fullspeed();
 	void process_debounce();
@@ -204,10 +817,92 @@ private:
 	void process_wait_address();
 	void process_set_conf();
 	void process_wait_conf();
+	void start_hid_requests();
+	int next_hid_request(unsigned char *request);
+	void process_set_hid();
+	void process_wait_hid();
+	int has_output_report();
+	void process_set_report();
+	void process_report_data();
+	void process_report_status();
+	void finish_output_report();
 	void process_work();
+	void wait_endpoints();
+	int has_due_endpoint();
+	void publish_raw_report(softusb_raw_report_t *slot, const unsigned char *packet, const softusb_endpoint_t *e, int length);
+	void parse_conf_byte(unsigned char value);
+	void parse_conf_item();
+	int get_endpoint_interval(int index);
+	void process_query_report_descr();
+	void process_read_report_descr();
+	void parse_report_byte(unsigned char value);
+	void parse_report_item();
+	void parse_report_input();
+	void add_report_field(int kind, unsigned int offset, int size, int count, int usage);
+	void finish_report_plan();
+	void start_polling();
+	int load_cached();
+	void store_cached();
 	
 	// Reports
-	void parse_keyboard_report();
-	void parse_mouse_report();
+	void decode_report(int intf, const unsigned char *data, int length);
+	int is_same_report(const softusb_endpoint_t *e, const unsigned char *data, int length);
+	void parse_keyboard_report(const unsigned int *keys);
+	void parse_mouse_report(int buttons, int dx, int dy, int dw);
 	void add_key(int code);
 };
+
+// Port and pins known at compile time: masks, register addresses and
+// mode register values are constants in the line level code
+template <unsigned int PORT, unsigned int MPIN, unsigned int PPIN>
+class SoftUsbT final : public SoftUsb
+{
+public:
+	SoftUsbT() : SoftUsb(PORT, MPIN, PPIN) {}
+
+protected:
+	static constexpr unsigned int _mpin = MPIN;
+	static constexpr unsigned int _ppin = PPIN;
+	static constexpr unsigned int _mmask = 1u << MPIN;
+	static constexpr unsigned int _pmask = 1u << PPIN;
+	static constexpr unsigned int _mpmask = (1u << MPIN) | (1u << PPIN);
+
+	SOFTUSB_PLATFORM_CONST(PORT, MPIN, PPIN);
+
+	virtual void line_output();
+	virtual void line_input();
+	virtual int read_line();
+	virtual void line_reset();
+	virtual void line_idle();
+	virtual void eop();
+	virtual int keepalive();
+	virtual int encode(const unsigned char *data, int count, unsigned int *wave);
+	virtual void transmit(const unsigned int *wave, int count);
+	virtual int receive(unsigned char *buffer, int n);
+};
+
+#define SOFTUSB_PHY_TEMPLATE	template <unsigned int PORT, unsigned int MPIN, unsigned int PPIN>
+#define SOFTUSB_PHY_CLASS		SoftUsbT<PORT, MPIN, PPIN>
+#include "softusb_phy.h"
+#undef SOFTUSB_PHY_TEMPLATE
+#undef SOFTUSB_PHY_CLASS
+
+// Scheduler for several ports sharing one 1 ms timer
+class SoftUsbHost
+{
+public:
+	SoftUsbHost(unsigned int budget = SOFTUSB_FRAME_BUDGET_TICKS);
+	
+	int add_port(SoftUsb *port);
+	void set_budget(unsigned int budget);
+	
+	// Should be called every 1 ms instead of timer1ms() of each port,
+	// overwrites control budgets of the ports
+	void timer1ms();
+
+private:
+	SoftUsb *_ports[SOFTUSB_HOST_MAX_PORTS];
+	unsigned int _waiting[SOFTUSB_HOST_MAX_PORTS];
+	int _count;
+	unsigned int _budget;
+};
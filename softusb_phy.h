@@ -0,0 +1,325 @@
+// Line level functions. Compiled for SoftUsb with pins set at runtime and
+// for every SoftUsbT with pins, masks and register addresses as constants.
+// Included by softusb.h and softusb.cpp with SOFTUSB_PHY_TEMPLATE and
+// SOFTUSB_PHY_CLASS defined.
+
+SOFTUSB_PHY_TEMPLATE
+void SOFTUSB_PHY_CLASS::line_output()
+{
+	SOFTUSB_OUTPUT;
+}
+
+SOFTUSB_PHY_TEMPLATE
+void SOFTUSB_PHY_CLASS::line_input()
+{
+	SOFTUSB_INPUT;
+}
+
+// SOFTUSB_LINE_DM and SOFTUSB_LINE_DP bits of D- and D+ levels
+SOFTUSB_PHY_TEMPLATE
+int SOFTUSB_PHY_CLASS::read_line()
+{
+	unsigned int v;
+	
+	SOFTUSB_READ(v);
+	
+	return (v & _mmask ? SOFTUSB_LINE_DM : 0) | (v & _pmask ? SOFTUSB_LINE_DP : 0);
+}
+
+// Drive SE0 for bus reset
+SOFTUSB_PHY_TEMPLATE
+void SOFTUSB_PHY_CLASS::line_reset()
+{
+	SOFTUSB_Z;
+	SOFTUSB_OUTPUT;
+}
+
+// End bus reset with J and release the line
+SOFTUSB_PHY_TEMPLATE
+void SOFTUSB_PHY_CLASS::line_idle()
+{
+	SOFTUSB_M;
+	SOFTUSB_INPUT;
+}
+
+SOFTUSB_PHY_TEMPLATE
+void SOFTUSB_PHY_CLASS::eop()
+{
+	unsigned int t;
+	SOFTUSB_WAIT;
+	SOFTUSB_Z;
+	SOFTUSB_WAIT;
+	SOFTUSB_WAIT;
+	SOFTUSB_M;
+	SOFTUSB_WAIT;
+}
+
+// Low-speed keepalive EOP, returns 0 without it if the line is not idle
+SOFTUSB_PHY_TEMPLATE
+int SOFTUSB_PHY_CLASS::keepalive()
+{
+	unsigned int v;
+	
+	SOFTUSB_READ(v);
+	v &= _mpmask;
+	
+	if (v != _mmask)
+	{
+		return 0;
+	}
+	
+	SOFTUSB_OUTPUT;
+	
+	eop();
+	
+	SOFTUSB_INPUT;
+	
+	return 1;
+}
+
+// Convert packet to a list of output words: NRZI bits, stuffed bits and EOP
+SOFTUSB_PHY_TEMPLATE
+int SOFTUSB_PHY_CLASS::encode(const unsigned char *data, int count, unsigned int *wave)
+{
+	int i, j;
+	int n = 0;
+	int ones = 0;
+	unsigned int b = _m;
+	unsigned int d;
+	
+	if (count > SOFTUSB_MAX_PACKET)
+	{
+		count = SOFTUSB_MAX_PACKET;
+	}
+	
+	for (i = 0; i < count; i++)
+	{
+		d = data[i];
+		
+		for (j = 0; j < 8; j++)
+		{
+			if (d & 1)
+			{
+				ones++;
+			}
+			else
+			{
+				b ^= _m | _p;
+				ones = 0;
+			}
+			
+			wave[n++] = b;
+			
+			// Insert 0 after six 1s
+			if (ones == 6)
+			{
+				b ^= _m | _p;
+				wave[n++] = b;
+				ones = 0;
+			}
+			
+			d >>= 1;
+		}
+	}
+	
+	// EOP
+	wave[n++] = _z;
+	wave[n++] = _z;
+	wave[n++] = _m;
+	
+	return n;
+}
+
+// Output prepared words, one per bit
+SOFTUSB_PHY_TEMPLATE
+void SOFTUSB_PHY_CLASS::transmit(const unsigned int *wave, int count)
+{
+	unsigned int t;
+#ifndef SOFTUSB_DMA_TX
+	int i;
+#endif
+
+	SOFTUSB_OUTPUT;
+	
+	SOFTUSB_M;
+	
+	SOFTUSB_WAIT;
+	
+#ifdef SOFTUSB_DMA_TX
+	// Words are written by DMA on timer requests, interrupts can't distort them.
+	// CPU waits anyway: receive() or the next packet follows right after EOP
+	SOFTUSB_DMA_TX_START(wave, count);
+	
+	while (SOFTUSB_DMA_TX_BUSY)
+	{
+	}
+#else
+	SOFTUSB_BEGIN_INTERVAL;
+	
+	for (i = 0; i < count; i++)
+	{
+		SOFTUSB_WAIT_TICK;
+		SOFTUSB_OUT(wave[i]);
+		SOFTUSB_BEGIN_INTERVAL;
+	}
+#endif
+
+	SOFTUSB_INPUT;
+
+	SOFTUSB_WAIT;
+}
+
+#ifdef SOFTUSB_DMA_RX
+// Line is sampled to RAM by DMA and decoded after EOP
+SOFTUSB_PHY_TEMPLATE
+int SOFTUSB_PHY_CLASS::receive(unsigned char *buffer, int n)
+{
+	volatile softusb_sample_t *captured = _samples;
+	int i = 0, count;
+	int started = 0;
+	unsigned int g;
+	
+	SOFTUSB_DMA_RX_START(_samples, SOFTUSB_DMA_RX_SAMPLES);
+	
+	// Wait for response and then for EOP
+	while (1)
+	{
+		count = SOFTUSB_DMA_RX_SAMPLES - SOFTUSB_DMA_RX_LEFT;
+		
+		if (count >= SOFTUSB_DMA_RX_SAMPLES)
+		{
+			break;
+		}
+		
+		if (count == 0)
+		{
+			continue;
+		}
+		
+		g = captured[count - 1] & _mpmask;
+		
+		if (!started)
+		{
+			if (g == _pmask)
+			{
+				started = 1;
+			}
+			else if (i++ > 10000)
+			{
+				break;
+			}
+		}
+		else if (g == 0)
+		{
+			break;
+		}
+	}
+	
+	SOFTUSB_DMA_RX_STOP;
+	
+	count = SOFTUSB_DMA_RX_SAMPLES - SOFTUSB_DMA_RX_LEFT;
+	
+	i = softusb_decode(_samples, count, SOFTUSB_DMA_RX_PERIOD, _mmask, _pmask, buffer, n);
+	
+	_rx_crc = i > 2 ? softusb_crc16(&buffer[2], i - 2) ^ 0xFFFFu : 0;
+	
+	return i;
+}
+#else
+// This is the most important function
+// We should run very quickly
+// The timer used to measure bit intervals should be very accurate
+// CRC16 of data bytes is updated in the spare time after each byte,
+// so the handshake can be chosen right after EOP
+SOFTUSB_PHY_TEMPLATE
+int SOFTUSB_PHY_CLASS::receive(unsigned char *buffer, int n)
+{
+	unsigned int t;
+	int res = 0;
+	int i, j;
+	unsigned int v = _pmask, g = _mmask;
+	int ones = 0;
+	unsigned int crc = 0xFFFFu;
+
+	// Wait for response
+	i = 0;
+	while (1)
+	{
+		SOFTUSB_READ(g);
+		
+		if (g & _pmask)
+		{
+			break;
+		}
+		
+		if (i++ > 10000)
+			return -1;
+	}
+	
+	t = 0;
+	
+#ifdef SOFTUSB_TRACE
+	// Timer restarts from 0, keep the time of transaction so far
+	_trace_ticks += (TIMER_1500_KHZ_VALUE - _trace_start) & 0xFFFF;
+	_trace_start = 0;
+#endif
+	
+	TIMER_1500_KHZ_SYNC;
+	
+	for (i = 0; i < n; i++)
+	{
+		for (j = i == 0; j < 8; j++)
+		{
+			SOFTUSB_WAIT_TICK;
+			SOFTUSB_BEGIN_INTERVAL;
+			res >>= 1;
+			SOFTUSB_READ(g);
+			g &= _mpmask;
+			
+			// Detect EOP
+			if (g == 0)
+			{
+				break;
+			}
+			
+			if ((v ^ g) == 0)
+			{
+				res |= 0x80;
+				ones++;
+				if (ones == 6)
+				{
+					ones = 0;
+					SOFTUSB_WAIT_TICK;
+					SOFTUSB_BEGIN_INTERVAL;
+					SOFTUSB_READ(g);
+					g &= _mpmask;
+				}
+			}
+			else
+				ones = 0;
+			v = g;
+		}
+		
+		if (g == 0)
+		{
+			break;
+		}
+		
+		buffer[i] = res;
+		
+		// Skip SYNC and PID
+		if (i >= 2)
+		{
+			crc ^= res;
+			crc = (crc >> 4) ^ _crc16_table[crc & 0x0F];
+			crc = (crc >> 4) ^ _crc16_table[crc & 0x0F];
+		}
+		
+		res = 0;
+	}
+	
+	_rx_crc = crc;
+	
+	return i;
+}
+#endif
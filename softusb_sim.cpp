@@ -0,0 +1,1243 @@
+#ifdef SOFTUSB_PLATFORM_HOST
+
+#include "softusb_sim.h"
+
+
+/////////////////////////////////////////////////////////////////////////
+// Consts
+/////////////////////////////////////////////////////////////////////////
+
+#define SIM_TOKEN_OUT			0xE1
+#define SIM_TOKEN_IN			0x69
+#define SIM_TOKEN_SETUP			0x2D
+#define SIM_DATA_DATA0			0xC3
+#define SIM_DATA_DATA1			0x4B
+#define SIM_HANDSHAKE_ACK		0xD2
+#define SIM_HANDSHAKE_NAK		0x5A
+#define SIM_HANDSHAKE_STALL		0x1E
+
+// Bit times between the end of a host packet and the device response
+#define SIM_TURNAROUND			4
+
+// SE0 longer than this number of bit times resets the device
+#define SIM_RESET_BITS			16
+
+// Control transfer stages
+#define SIM_CTL_IDLE			0
+#define SIM_CTL_DATA_IN			1
+#define SIM_CTL_STATUS_IN		2
+#define SIM_CTL_DATA_OUT		3
+#define SIM_CTL_STALL			4
+
+/////////////////////////////////////////////////////////////////////////
+// Descriptors
+/////////////////////////////////////////////////////////////////////////
+
+static const unsigned char keyboard_device_descr[18] =
+{
+	0x12, 0x01, 0x10, 0x01, 0x00, 0x00, 0x00, 0x08, 0x09, 0x12, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+};
+
+static const unsigned char mouse_device_descr[18] =
+{
+	0x12, 0x01, 0x10, 0x01, 0x00, 0x00, 0x00, 0x08, 0x09, 0x12, 0x02, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+};
+
+static const unsigned char composite_device_descr[18] =
+{
+	0x12, 0x01, 0x10, 0x01, 0x00, 0x00, 0x00, 0x08, 0x09, 0x12, 0x03, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+};
+
+static const unsigned char hires_mouse_device_descr[18] =
+{
+	0x12, 0x01, 0x10, 0x01, 0x00, 0x00, 0x00, 0x08, 0x09, 0x12, 0x04, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+};
+
+static const unsigned char gamepad_device_descr[18] =
+{
+	0x12, 0x01, 0x10, 0x01, 0x00, 0x00, 0x00, 0x08, 0x09, 0x12, 0x05, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+};
+
+static const unsigned char tablet_device_descr[18] =
+{
+	0x12, 0x01, 0x10, 0x01, 0x00, 0x00, 0x00, 0x08, 0x09, 0x12, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+};
+
+static const unsigned char nkro_keyboard_device_descr[18] =
+{
+	0x12, 0x01, 0x10, 0x01, 0x00, 0x00, 0x00, 0x08, 0x09, 0x12, 0x07, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01
+};
+
+// Boot keyboard with LEDs
+static const unsigned char keyboard_report_descr[] =
+{
+	0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+	0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01,
+	0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+	0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xC0
+};
+
+// Boot mouse with a wheel
+static const unsigned char mouse_report_descr[] =
+{
+	0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09, 0x19, 0x01, 0x29, 0x03,
+	0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+	0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x03,
+	0x81, 0x06, 0xC0, 0xC0
+};
+
+// Report protocol mouse: report ID 1, 5 buttons, 16-bit X and Y, 8-bit wheel
+static const unsigned char hires_mouse_report_descr[] =
+{
+	0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x85, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09, 0x19, 0x01,
+	0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x03,
+	0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01, 0x80, 0x26, 0xFF, 0x7F, 0x75, 0x10,
+	0x95, 0x02, 0x81, 0x06, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01, 0x81, 0x06,
+	0xC0, 0xC0
+};
+
+// Gamepad: 8 buttons, 8-bit X and Y
+static const unsigned char gamepad_report_descr[] =
+{
+	0x05, 0x01, 0x09, 0x05, 0xA1, 0x01, 0x05, 0x09, 0x19, 0x01, 0x29, 0x08, 0x15, 0x00, 0x25, 0x01,
+	0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81, 0x25, 0x7F,
+	0x75, 0x08, 0x95, 0x02, 0x81, 0x02, 0xC0
+};
+
+// Tablet in a mouse collection: 3 buttons, 16-bit absolute X and Y, relative wheel
+static const unsigned char tablet_report_descr[] =
+{
+	0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09, 0x19, 0x01, 0x29, 0x03,
+	0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+	0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x00, 0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02, 0x81,
+	0x02, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01, 0x81, 0x06, 0xC0, 0xC0
+};
+
+// NKRO keyboard with LEDs: modifiers and a bitmap of usages 0x04..0x3B
+static const unsigned char nkro_keyboard_report_descr[] =
+{
+	0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+	0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x19, 0x04, 0x29, 0x3B, 0x95, 0x38, 0x81, 0x02, 0x95, 0x05,
+	0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0xC0
+};
+
+#define SIM_CONF(total, interfaces) \
+	0x09, 0x02, (total) & 0xFF, (total) >> 8, interfaces, 0x01, 0x00, 0xA0, 0x32
+
+#define SIM_HID_INTERFACE(number, protocol, report_length, ep) \
+	0x09, 0x04, number, 0x00, 0x01, 0x03, 0x01, protocol, 0x00,	\
+	0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, (report_length) & 0xFF, (report_length) >> 8,	\
+	0x07, 0x05, 0x80 | (ep), 0x03, 0x08, 0x00, 0x0A
+
+static const unsigned char keyboard_conf_descr[] =
+{
+	SIM_CONF(34, 1),
+	SIM_HID_INTERFACE(0, 1, sizeof(keyboard_report_descr), 1)
+};
+
+static const unsigned char mouse_conf_descr[] =
+{
+	SIM_CONF(34, 1),
+	SIM_HID_INTERFACE(0, 2, sizeof(mouse_report_descr), 1)
+};
+
+static const unsigned char composite_conf_descr[] =
+{
+	SIM_CONF(59, 2),
+	SIM_HID_INTERFACE(0, 1, sizeof(keyboard_report_descr), 1),
+	SIM_HID_INTERFACE(1, 2, sizeof(mouse_report_descr), 2)
+};
+
+static const unsigned char hires_mouse_conf_descr[] =
+{
+	SIM_CONF(34, 1),
+	SIM_HID_INTERFACE(0, 2, sizeof(hires_mouse_report_descr), 1)
+};
+
+// Not a boot device: subclass and protocol 0
+static const unsigned char gamepad_conf_descr[] =
+{
+	SIM_CONF(34, 1),
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x03, 0x00, 0x00, 0x00,
+	0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, sizeof(gamepad_report_descr), 0x00,
+	0x07, 0x05, 0x81, 0x03, 0x08, 0x00, 0x0A
+};
+
+static const unsigned char tablet_conf_descr[] =
+{
+	SIM_CONF(34, 1),
+	0x09, 0x04, 0x00, 0x00, 0x01, 0x03, 0x00, 0x00, 0x00,
+	0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, sizeof(tablet_report_descr), 0x00,
+	0x07, 0x05, 0x81, 0x03, 0x08, 0x00, 0x0A
+};
+
+static const unsigned char nkro_keyboard_conf_descr[] =
+{
+	SIM_CONF(34, 1),
+	SIM_HID_INTERFACE(0, 1, sizeof(nkro_keyboard_report_descr), 1)
+};
+
+/////////////////////////////////////////////////////////////////////////
+// Clock
+/////////////////////////////////////////////////////////////////////////
+
+static unsigned long long sim_time = 0;
+static unsigned long long sim_timer_base = 0;
+static SoftUsbSimBus sim_buses[SOFTUSB_SIM_MAX_PORTS];
+static int sim_bus_used[SOFTUSB_SIM_MAX_PORTS];
+
+static void sim_advance()
+{
+	int i;
+
+	sim_time++;
+
+	for (i = 0; i < SOFTUSB_SIM_MAX_PORTS; i++)
+	{
+		if (sim_bus_used[i])
+		{
+			sim_buses[i].step();
+		}
+	}
+}
+
+unsigned int softusb_sim_timer()
+{
+	sim_advance();
+
+	return (unsigned int)((sim_time - sim_timer_base) / SOFTUSB_SIM_SUBTICKS) & 0xFFFF;
+}
+
+void softusb_sim_timer_sync()
+{
+	sim_advance();
+
+	sim_timer_base = sim_time;
+}
+
+unsigned long long softusb_sim_time()
+{
+	return sim_time;
+}
+
+void softusb_sim_run(unsigned long long steps)
+{
+	while (steps-- > 0)
+	{
+		sim_advance();
+	}
+}
+
+void softusb_sim_run_until(unsigned long long time)
+{
+	while (sim_time < time)
+	{
+		sim_advance();
+	}
+}
+
+SoftUsbSimBus *softusb_sim_bus(unsigned int port)
+{
+	port %= SOFTUSB_SIM_MAX_PORTS;
+
+	sim_bus_used[port] = 1;
+
+	return &sim_buses[port];
+}
+
+/////////////////////////////////////////////////////////////////////////
+// CRC
+/////////////////////////////////////////////////////////////////////////
+
+static unsigned short sim_crc16(const unsigned char *data, int count)
+{
+	int i, j;
+	unsigned short crc = 0xFFFFu;
+
+	for (i = 0; i < count; i++)
+	{
+		crc ^= data[i];
+
+		for (j = 0; j < 8; j++)
+		{
+			if (crc & 0x0001)
+				crc = (crc >> 1) ^ 0xA001;
+			else
+				crc = crc >> 1;
+		}
+	}
+
+	return crc ^ 0xFFFFu;
+}
+
+static unsigned int sim_crc5(unsigned int data)
+{
+	unsigned int b = 0x1F;
+	int i;
+
+	for (i = 0; i < 11; i++)
+	{
+		if ((data ^ b) & 1)
+			b = (b >> 1) ^ 0x14;
+		else
+			b >>= 1;
+		data >>= 1;
+	}
+
+	return b ^ 0x1F;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// Bus
+/////////////////////////////////////////////////////////////////////////
+
+SoftUsbSimBus::SoftUsbSimBus()
+{
+	_mmask = 0;
+	_pmask = 0;
+	_pins = 0;
+	_output = 0;
+	_model = SOFTUSB_SIM_NONE;
+	_level = SOFTUSB_SIM_SE0;
+	_random = 12345;
+	_tx_pending = 0;
+	_dma_tx_count = 0;
+	_dma_rx_count = 0;
+	_dma_rx_enabled = 0;
+
+	_faults.bit_error_ppm = 0;
+	_faults.drift_ppm = 0;
+	_faults.drop_handshake_percent = 0;
+	_faults.nak_percent = 0;
+	_faults.lost_ack_percent = 0;
+	_hid_requests = SOFTUSB_SIM_HID_ACCEPT;
+
+	reset_device();
+}
+
+void SoftUsbSimBus::attach_host(unsigned int mpin, unsigned int ppin)
+{
+	_mmask = 1u << mpin;
+	_pmask = 1u << ppin;
+}
+
+void SoftUsbSimBus::write(unsigned int bsrr)
+{
+	sim_advance();
+
+	_pins |= bsrr & 0xFFFFu;
+	_pins &= ~(bsrr >> 16);
+}
+
+void SoftUsbSimBus::set_output(int output)
+{
+	_output = output;
+}
+
+unsigned int SoftUsbSimBus::read()
+{
+	sim_advance();
+
+	return sample();
+}
+
+unsigned int SoftUsbSimBus::sample()
+{
+	int level = line();
+
+	return ((level & SOFTUSB_SIM_J) ? _mmask : 0) | ((level & SOFTUSB_SIM_K) ? _pmask : 0);
+}
+
+void SoftUsbSimBus::dma_tx_start(const unsigned int *wave, int count)
+{
+	sim_advance();
+
+	_dma_tx_wave = wave;
+	_dma_tx_count = count;
+	// First word is written on the next timer update, like a bit-banged one
+	_dma_tx_next = (sim_time + SOFTUSB_SIM_SUBTICKS - (sim_time - sim_timer_base) % SOFTUSB_SIM_SUBTICKS) * 256;
+}
+
+int SoftUsbSimBus::dma_tx_left()
+{
+	sim_advance();
+
+	return _dma_tx_count;
+}
+
+void SoftUsbSimBus::dma_rx_start(unsigned short *buffer, int count, unsigned int period)
+{
+	sim_advance();
+
+	_dma_rx_buffer = buffer;
+	_dma_rx_count = count;
+	_dma_rx_enabled = 1;
+	_dma_rx_next = sim_time * 256;
+	// Simulation steps per sample, 1/256 units
+	_dma_rx_step = SOFTUSB_SIM_SUBTICKS * 256ull * 256 / period;
+}
+
+int SoftUsbSimBus::dma_rx_left()
+{
+	sim_advance();
+
+	return _dma_rx_count;
+}
+
+// Number of samples left is kept like NDTR of a disabled stream
+void SoftUsbSimBus::dma_rx_stop()
+{
+	sim_advance();
+
+	_dma_rx_enabled = 0;
+}
+
+// Timer-requested transfers, one word per bit and one sample per period
+void SoftUsbSimBus::dma_step(unsigned long long now)
+{
+	if (_dma_tx_count > 0 && now >= _dma_tx_next)
+	{
+		_pins |= *_dma_tx_wave & 0xFFFFu;
+		_pins &= ~(*_dma_tx_wave >> 16);
+		_dma_tx_wave++;
+		_dma_tx_count--;
+		_dma_tx_next += SOFTUSB_SIM_SUBTICKS * 256;
+	}
+
+	if (_dma_rx_enabled && _dma_rx_count > 0 && now >= _dma_rx_next)
+	{
+		*_dma_rx_buffer++ = sample();
+		_dma_rx_count--;
+		_dma_rx_next += _dma_rx_step;
+	}
+}
+
+void SoftUsbSimBus::attach_device(int model)
+{
+	int i;
+
+	_model = model;
+
+	switch (model)
+	{
+		case SOFTUSB_SIM_KEYBOARD:
+			_device_descr = keyboard_device_descr;
+			_conf_descr = keyboard_conf_descr;
+			_conf_length = sizeof(keyboard_conf_descr);
+			_report_descr[0] = keyboard_report_descr;
+			_report_length[0] = sizeof(keyboard_report_descr);
+			break;
+		case SOFTUSB_SIM_MOUSE:
+			_device_descr = mouse_device_descr;
+			_conf_descr = mouse_conf_descr;
+			_conf_length = sizeof(mouse_conf_descr);
+			_report_descr[0] = mouse_report_descr;
+			_report_length[0] = sizeof(mouse_report_descr);
+			break;
+		case SOFTUSB_SIM_COMPOSITE:
+			_device_descr = composite_device_descr;
+			_conf_descr = composite_conf_descr;
+			_conf_length = sizeof(composite_conf_descr);
+			_report_descr[0] = keyboard_report_descr;
+			_report_length[0] = sizeof(keyboard_report_descr);
+			_report_descr[1] = mouse_report_descr;
+			_report_length[1] = sizeof(mouse_report_descr);
+			break;
+		case SOFTUSB_SIM_HIRES_MOUSE:
+			_device_descr = hires_mouse_device_descr;
+			_conf_descr = hires_mouse_conf_descr;
+			_conf_length = sizeof(hires_mouse_conf_descr);
+			_report_descr[0] = hires_mouse_report_descr;
+			_report_length[0] = sizeof(hires_mouse_report_descr);
+			break;
+		case SOFTUSB_SIM_GAMEPAD:
+			_device_descr = gamepad_device_descr;
+			_conf_descr = gamepad_conf_descr;
+			_conf_length = sizeof(gamepad_conf_descr);
+			_report_descr[0] = gamepad_report_descr;
+			_report_length[0] = sizeof(gamepad_report_descr);
+			break;
+		case SOFTUSB_SIM_TABLET:
+			_device_descr = tablet_device_descr;
+			_conf_descr = tablet_conf_descr;
+			_conf_length = sizeof(tablet_conf_descr);
+			_report_descr[0] = tablet_report_descr;
+			_report_length[0] = sizeof(tablet_report_descr);
+			break;
+		case SOFTUSB_SIM_NKRO_KEYBOARD:
+			_device_descr = nkro_keyboard_device_descr;
+			_conf_descr = nkro_keyboard_conf_descr;
+			_conf_length = sizeof(nkro_keyboard_conf_descr);
+			_report_descr[0] = nkro_keyboard_report_descr;
+			_report_length[0] = sizeof(nkro_keyboard_report_descr);
+			break;
+	}
+
+	for (i = 0; i < SOFTUSB_SIM_MAX_ENDPOINTS; i++)
+	{
+		_report_rp[i] = 0;
+		_report_wp[i] = 0;
+	}
+
+	_stats.tokens = 0;
+	_stats.setups = 0;
+	_stats.ins = 0;
+	_stats.outs = 0;
+	_stats.naks = 0;
+	_stats.reports = 0;
+	_stats.crc_errors = 0;
+	_stats.resets = 0;
+	_stats.retransmits = 0;
+
+	reset_device();
+}
+
+void SoftUsbSimBus::detach_device()
+{
+	_model = SOFTUSB_SIM_NONE;
+	_tx_pending = 0;
+	reset_device();
+}
+
+int SoftUsbSimBus::add_report(int ep, const unsigned char *data, int length)
+{
+	int i;
+	softusb_sim_report_t *r;
+
+	ep--;
+
+	if (ep < 0 || ep >= SOFTUSB_SIM_MAX_ENDPOINTS || length > 8)
+	{
+		return 0;
+	}
+
+	if (_report_wp[ep] - _report_rp[ep] >= SOFTUSB_SIM_REPORT_QUEUE)
+	{
+		return 0;
+	}
+
+	r = &_reports[ep][_report_wp[ep] % SOFTUSB_SIM_REPORT_QUEUE];
+
+	for (i = 0; i < length; i++)
+	{
+		r->data[i] = data[i];
+	}
+	r->length = length;
+
+	_report_wp[ep]++;
+
+	return 1;
+}
+
+void SoftUsbSimBus::set_faults(const softusb_sim_faults_t &faults)
+{
+	_faults = faults;
+}
+
+const softusb_sim_stats_t *SoftUsbSimBus::get_stats()
+{
+	return &_stats;
+}
+
+unsigned char SoftUsbSimBus::get_address()
+{
+	return _address;
+}
+
+unsigned char SoftUsbSimBus::get_leds()
+{
+	return _leds;
+}
+
+unsigned char SoftUsbSimBus::get_protocol(int intf)
+{
+	return _protocol[intf & 1];
+}
+
+unsigned char SoftUsbSimBus::get_idle(int intf)
+{
+	return _idle[intf & 1];
+}
+
+const unsigned char *SoftUsbSimBus::get_setup()
+{
+	return _setup;
+}
+
+void SoftUsbSimBus::set_hid_requests(int mode)
+{
+	_hid_requests = mode;
+}
+
+// Device bit time in 1/256 of a simulation step
+unsigned int SoftUsbSimBus::period()
+{
+	return (unsigned int)((long long)SOFTUSB_SIM_SUBTICKS * 256 * (1000000 + _faults.drift_ppm) / 1000000);
+}
+
+unsigned int SoftUsbSimBus::random()
+{
+	_random = _random * 1103515245u + 12345u;
+
+	return _random >> 8;
+}
+
+int SoftUsbSimBus::percent(unsigned int value)
+{
+	return value > 0 && random() % 100 < value;
+}
+
+// Current bus level: host drive wins, then device drive, then pull-ups
+int SoftUsbSimBus::line()
+{
+	int level = 0;
+
+	if (_output)
+	{
+		if (_pins & _mmask)
+		{
+			level |= SOFTUSB_SIM_J;
+		}
+		if (_pins & _pmask)
+		{
+			level |= SOFTUSB_SIM_K;
+		}
+		return level;
+	}
+
+	if (_tx_pending && _tx_pos >= 0)
+	{
+		return _tx_levels[_tx_pos];
+	}
+
+	switch (_model)
+	{
+		case SOFTUSB_SIM_NONE:
+			return SOFTUSB_SIM_SE0;
+		case SOFTUSB_SIM_FULLSPEED:
+			return SOFTUSB_SIM_K;
+	}
+
+	return SOFTUSB_SIM_J;
+}
+
+void SoftUsbSimBus::reset_device()
+{
+	int i;
+
+	_address = 0;
+	_new_address = 0;
+	_configuration = 0;
+	_leds = 0;
+	_se0 = 0;
+	_rx_active = 0;
+	_rx_last = SOFTUSB_SIM_SE0;
+	_token_valid = 0;
+	_setup_valid = 0;
+	_ctl_data = 0;
+	_ctl_status = SIM_CTL_IDLE;
+	_awaiting_ack = 0;
+	_tx_pos = -1;
+
+	for (i = 0; i < 2; i++)
+	{
+		// Report protocol after reset, keyboards idle at 500 ms
+		_protocol[i] = 1;
+		_idle[i] = 0;
+	}
+
+	if (_model == SOFTUSB_SIM_KEYBOARD || _model == SOFTUSB_SIM_COMPOSITE || _model == SOFTUSB_SIM_NKRO_KEYBOARD)
+	{
+		_idle[0] = 125;
+	}
+
+	for (i = 0; i < SOFTUSB_SIM_MAX_ENDPOINTS; i++)
+	{
+		_report_toggle[i] = 0;
+		_last_report[i].length = -1;
+		_last_report_time[i] = 0;
+	}
+}
+
+void SoftUsbSimBus::step()
+{
+	unsigned long long now = sim_time * 256;
+	int level;
+
+	dma_step(now);
+
+	if (_model == SOFTUSB_SIM_NONE || _model == SOFTUSB_SIM_FULLSPEED)
+	{
+		return;
+	}
+
+	// Device transmitter
+	if (_tx_pending)
+	{
+		if (now < _tx_start)
+		{
+			_tx_pos = -1;
+		}
+		else
+		{
+			_tx_pos = (int)((now - _tx_start) / period());
+
+			if (_tx_pos >= _tx_count)
+			{
+				_tx_pending = 0;
+				_tx_pos = -1;
+			}
+			else if (_tx_pos < _tx_count - 3)
+			{
+				_rx_last = _tx_levels[_tx_pos];
+				return;
+			}
+		}
+	}
+
+	level = line();
+
+	// End of packet and bus reset
+	if (level == SOFTUSB_SIM_SE0)
+	{
+		_se0++;
+
+		if (_se0 == SIM_RESET_BITS * SOFTUSB_SIM_SUBTICKS)
+		{
+			_stats.resets++;
+			reset_device();
+			_se0 = SIM_RESET_BITS * SOFTUSB_SIM_SUBTICKS + 1;
+		}
+	}
+	else
+	{
+		if (_se0 > 0 && level == SOFTUSB_SIM_J && _rx_active)
+		{
+			_rx_active = 0;
+			rx_packet();
+		}
+
+		_se0 = 0;
+	}
+
+	// Receiver with resynchronization on every transition
+	if (!_rx_active)
+	{
+		if (level == SOFTUSB_SIM_K && _rx_last == SOFTUSB_SIM_J)
+		{
+			rx_start(now);
+		}
+	}
+	else if (level != SOFTUSB_SIM_SE0)
+	{
+		if (level != _rx_last)
+		{
+			_rx_next = now + period() / 2;
+		}
+		else if (now >= _rx_next)
+		{
+			rx_bit(level);
+			_rx_next += period();
+		}
+	}
+
+	_rx_last = level;
+}
+
+void SoftUsbSimBus::rx_start(unsigned long long now)
+{
+	int i;
+
+	_rx_active = 1;
+	_rx_prev = SOFTUSB_SIM_J;
+	_rx_ones = 0;
+	_rx_bits = 0;
+	_rx_error = 0;
+	_rx_next = now + period() / 2;
+
+	for (i = 0; i < SOFTUSB_SIM_MAX_PACKET; i++)
+	{
+		_rx[i] = 0;
+	}
+}
+
+void SoftUsbSimBus::rx_bit(int level)
+{
+	int bit = level == _rx_prev;
+
+	_rx_prev = level;
+
+	// Stuffed bit
+	if (_rx_ones == 6)
+	{
+		_rx_ones = 0;
+
+		if (bit)
+		{
+			_rx_error = 1;
+		}
+		return;
+	}
+
+	if (bit)
+	{
+		_rx_ones++;
+	}
+	else
+	{
+		_rx_ones = 0;
+	}
+
+	if (_rx_bits < SOFTUSB_SIM_MAX_PACKET * 8)
+	{
+		if (bit)
+		{
+			_rx[_rx_bits / 8] |= 1 << (_rx_bits % 8);
+		}
+		_rx_bits++;
+	}
+}
+
+void SoftUsbSimBus::rx_packet()
+{
+	int n = _rx_bits / 8;
+	unsigned char pid;
+	unsigned int token;
+	unsigned short crc;
+	int i;
+
+	if (n < 2 || _rx_error || _rx[0] != 0x80)
+	{
+		return;
+	}
+
+	pid = _rx[1];
+
+	if (((pid & 0x0F) ^ (pid >> 4)) != 0x0F)
+	{
+		return;
+	}
+
+	switch (pid)
+	{
+		case SIM_TOKEN_OUT:
+		case SIM_TOKEN_IN:
+		case SIM_TOKEN_SETUP:
+			if (n < 4)
+			{
+				return;
+			}
+
+			token = _rx[2] | (_rx[3] << 8);
+
+			if (sim_crc5(token & 0x7FF) != (token >> 11))
+			{
+				_stats.crc_errors++;
+				_token_valid = 0;
+				return;
+			}
+
+			if ((token & 0x7F) != _address)
+			{
+				_token_valid = 0;
+				return;
+			}
+
+			_stats.tokens++;
+			_token = pid;
+			_token_ep = (token >> 7) & 0x0F;
+			_token_valid = 1;
+
+			if (pid == SIM_TOKEN_IN)
+			{
+				_token_valid = 0;
+				handle_in(_token_ep);
+			}
+			return;
+
+		case SIM_DATA_DATA0:
+		case SIM_DATA_DATA1:
+			if (!_token_valid || n < 4)
+			{
+				return;
+			}
+
+			_token_valid = 0;
+
+			crc = sim_crc16(&_rx[2], n - 4);
+
+			if (_rx[n - 2] != (crc & 0xFF) || _rx[n - 1] != (crc >> 8))
+			{
+				_stats.crc_errors++;
+				return;
+			}
+
+			if (percent(_faults.drop_handshake_percent))
+			{
+				return;
+			}
+
+			if (_token == SIM_TOKEN_SETUP)
+			{
+				if (n - 4 != 8)
+				{
+					return;
+				}
+
+				// SET_IDLE or SET_PROTOCOL is not acknowledged
+				if (_hid_requests == SOFTUSB_SIM_HID_NO_SETUP && _rx[2] == 0x21 &&
+					(_rx[3] == 0x0A || _rx[3] == 0x0B))
+				{
+					return;
+				}
+
+				for (i = 0; i < 8; i++)
+				{
+					_setup[i] = _rx[2 + i];
+				}
+
+				transmit_pid(SIM_HANDSHAKE_ACK);
+				handle_setup();
+			}
+			else if (_token == SIM_TOKEN_OUT)
+			{
+				_stats.outs++;
+
+				if (_ctl_status == SIM_CTL_STALL || _token_ep != 0)
+				{
+					transmit_pid(SIM_HANDSHAKE_STALL);
+					return;
+				}
+
+				transmit_pid(SIM_HANDSHAKE_ACK);
+				handle_out(&_rx[2], n - 4);
+			}
+			return;
+
+		case SIM_HANDSHAKE_ACK:
+			if (!_awaiting_ack)
+			{
+				return;
+			}
+
+			// Report stays pending and is sent again
+			if (_awaiting_ep != 0 && percent(_faults.lost_ack_percent))
+			{
+				return;
+			}
+
+			_awaiting_ack = 0;
+
+			if (_awaiting_ep == 0)
+			{
+				if (_ctl_status == SIM_CTL_STATUS_IN)
+				{
+					if (_new_address)
+					{
+						_address = _new_address;
+						_new_address = 0;
+					}
+					_ctl_status = SIM_CTL_IDLE;
+				}
+				else if (_ctl_status == SIM_CTL_DATA_IN)
+				{
+					_ctl_offset += _ctl_chunk;
+					_ctl_toggle ^= 1;
+				}
+			}
+			else
+			{
+				i = _awaiting_ep - 1;
+
+				if (_report_rp[i] != _report_wp[i])
+				{
+					_last_report[i] = _reports[i][_report_rp[i] % SOFTUSB_SIM_REPORT_QUEUE];
+					_report_rp[i]++;
+				}
+				_last_report_time[i] = sim_time;
+				_report_toggle[i] ^= 1;
+				_stats.reports++;
+			}
+			return;
+	}
+}
+
+void SoftUsbSimBus::handle_setup()
+{
+	unsigned char type = _setup[0];
+	unsigned char request = _setup[1];
+	unsigned short value = _setup[2] | (_setup[3] << 8);
+	unsigned short index = _setup[4] | (_setup[5] << 8);
+	unsigned short length = _setup[6] | (_setup[7] << 8);
+	int intf = index & 1;
+
+	_stats.setups++;
+
+	_ctl_data = 0;
+	_ctl_length = 0;
+	_ctl_offset = 0;
+	_ctl_chunk = 0;
+	_ctl_toggle = 1;
+	_ctl_status = SIM_CTL_STALL;
+	_awaiting_ack = 0;
+
+	if (type & 0x80)
+	{
+		if (request == 0x06)
+		{
+			switch (value >> 8)
+			{
+				case 0x01:
+					_ctl_data = _device_descr;
+					_ctl_length = 18;
+					break;
+				case 0x02:
+					_ctl_data = _conf_descr;
+					_ctl_length = _conf_length;
+					break;
+				case 0x22:
+					if (intf == 0 || _model == SOFTUSB_SIM_COMPOSITE)
+					{
+						_ctl_data = _report_descr[intf];
+						_ctl_length = _report_length[intf];
+					}
+					break;
+			}
+		}
+		else if (request == 0x08)
+		{
+			_ctl_data = &_configuration;
+			_ctl_length = 1;
+		}
+
+		if (_ctl_data)
+		{
+			if (_ctl_length > length)
+			{
+				_ctl_length = length;
+			}
+			_ctl_status = SIM_CTL_DATA_IN;
+		}
+		return;
+	}
+
+	if (type == 0x00 && request == 0x05)
+	{
+		_new_address = value & 0x7F;
+		_ctl_status = SIM_CTL_STATUS_IN;
+	}
+	else if (type == 0x00 && request == 0x09)
+	{
+		_configuration = value;
+		_report_toggle[0] = 0;
+		_report_toggle[1] = 0;
+		_ctl_status = SIM_CTL_STATUS_IN;
+	}
+	else if (type == 0x21 && (request == 0x0A || request == 0x0B) &&
+		_hid_requests == SOFTUSB_SIM_HID_STALL)
+	{
+		// Not supported, STALL stays
+	}
+	else if (type == 0x21 && request == 0x0A)
+	{
+		_idle[intf] = value >> 8;
+		_ctl_status = SIM_CTL_STATUS_IN;
+	}
+	else if (type == 0x21 && request == 0x0B)
+	{
+		_protocol[intf] = value;
+		_ctl_status = SIM_CTL_STATUS_IN;
+	}
+	else if (type == 0x21 && request == 0x09 && length > 0)
+	{
+		_ctl_status = SIM_CTL_DATA_OUT;
+	}
+}
+
+void SoftUsbSimBus::handle_in(int ep)
+{
+	softusb_sim_report_t *r = 0;
+	unsigned long long idle;
+	int chunk;
+
+	_stats.ins++;
+
+	if (_awaiting_ack && _awaiting_ep == ep)
+	{
+		_stats.retransmits++;
+	}
+
+	if (ep == 0)
+	{
+		switch (_ctl_status)
+		{
+			case SIM_CTL_STATUS_IN:
+				transmit_data(SIM_DATA_DATA1, 0, 0);
+				_awaiting_ack = 1;
+				_awaiting_ep = 0;
+				return;
+			case SIM_CTL_DATA_IN:
+				chunk = _ctl_length - _ctl_offset;
+				if (chunk > 8)
+				{
+					chunk = 8;
+				}
+				if (chunk < 0)
+				{
+					chunk = 0;
+				}
+				_ctl_chunk = chunk;
+				transmit_data(_ctl_toggle ? SIM_DATA_DATA1 : SIM_DATA_DATA0, _ctl_data + _ctl_offset, chunk);
+				_awaiting_ack = 1;
+				_awaiting_ep = 0;
+				return;
+			case SIM_CTL_STALL:
+				transmit_pid(SIM_HANDSHAKE_STALL);
+				return;
+		}
+
+		transmit_pid(SIM_HANDSHAKE_NAK);
+		return;
+	}
+
+	ep--;
+
+	if (ep >= SOFTUSB_SIM_MAX_ENDPOINTS || !_configuration ||
+		(ep > 0 && _model != SOFTUSB_SIM_COMPOSITE))
+	{
+		transmit_pid(SIM_HANDSHAKE_STALL);
+		return;
+	}
+
+	if (_report_rp[ep] != _report_wp[ep])
+	{
+		r = &_reports[ep][_report_rp[ep] % SOFTUSB_SIM_REPORT_QUEUE];
+	}
+	else if (_idle[ep] != 0 && _last_report[ep].length >= 0)
+	{
+		// Repeat the last report at the idle rate
+		idle = (unsigned long long)_idle[ep] * 4 * 1500 * SOFTUSB_SIM_SUBTICKS;
+
+		if (sim_time - _last_report_time[ep] >= idle)
+		{
+			r = &_last_report[ep];
+		}
+	}
+
+	if (r == 0 || percent(_faults.nak_percent))
+	{
+		_stats.naks++;
+
+		if (percent(_faults.drop_handshake_percent))
+		{
+			return;
+		}
+
+		transmit_pid(SIM_HANDSHAKE_NAK);
+		return;
+	}
+
+	transmit_data(_report_toggle[ep] ? SIM_DATA_DATA1 : SIM_DATA_DATA0, r->data, r->length);
+	_awaiting_ack = 1;
+	_awaiting_ep = ep + 1;
+}
+
+void SoftUsbSimBus::handle_out(const unsigned char *data, int length)
+{
+	switch (_ctl_status)
+	{
+		case SIM_CTL_DATA_IN:
+			// Status stage of a control read
+			_ctl_status = SIM_CTL_IDLE;
+			break;
+		case SIM_CTL_DATA_OUT:
+			if (length > 0)
+			{
+				// Skip the report ID if there is one
+				_leds = data[_setup[2] != 0 && length > 1 ? 1 : 0];
+			}
+			_ctl_status = SIM_CTL_STATUS_IN;
+			break;
+	}
+}
+
+void SoftUsbSimBus::transmit(const unsigned char *data, int count)
+{
+	int i, j;
+	int level = SOFTUSB_SIM_J;
+	int ones = 0;
+
+	_tx_count = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		for (j = 0; j < 8; j++)
+		{
+			if ((data[i] & (1 << j)) == 0)
+			{
+				level ^= SOFTUSB_SIM_J | SOFTUSB_SIM_K;
+				ones = 0;
+			}
+			else
+			{
+				ones++;
+			}
+
+			if (_faults.bit_error_ppm > 0 && random() % 1000000 < _faults.bit_error_ppm)
+			{
+				_tx_levels[_tx_count++] = level ^ (SOFTUSB_SIM_J | SOFTUSB_SIM_K);
+			}
+			else
+			{
+				_tx_levels[_tx_count++] = level;
+			}
+
+			if (ones == 6)
+			{
+				level ^= SOFTUSB_SIM_J | SOFTUSB_SIM_K;
+				_tx_levels[_tx_count++] = level;
+				ones = 0;
+			}
+		}
+	}
+
+	_tx_levels[_tx_count++] = SOFTUSB_SIM_SE0;
+	_tx_levels[_tx_count++] = SOFTUSB_SIM_SE0;
+	_tx_levels[_tx_count++] = SOFTUSB_SIM_J;
+
+	_tx_start = sim_time * 256 + SIM_TURNAROUND * period();
+	_tx_pending = 1;
+	_tx_pos = -1;
+}
+
+void SoftUsbSimBus::transmit_pid(unsigned char pid)
+{
+	unsigned char buf[2];
+
+	buf[0] = 0x80;
+	buf[1] = pid;
+
+	transmit(buf, 2);
+}
+
+void SoftUsbSimBus::transmit_data(unsigned char pid, const unsigned char *data, int count)
+{
+	unsigned char buf[12];
+	unsigned short crc = sim_crc16(data, count);
+	int i;
+
+	buf[0] = 0x80;
+	buf[1] = pid;
+
+	for (i = 0; i < count; i++)
+	{
+		buf[2 + i] = data[i];
+	}
+
+	buf[2 + count] = crc & 0xFF;
+	buf[3 + count] = crc >> 8;
+
+	transmit(buf, count + 4);
+}
+
+#endif
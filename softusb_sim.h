@@ -0,0 +1,211 @@
+#pragma once
+
+/////////////////////////////////////////////////////////////////////////
+// Host simulation of the USB bus and a low-speed device
+/////////////////////////////////////////////////////////////////////////
+
+// Simulation steps per 1.5 MHz bit time
+#define SOFTUSB_SIM_SUBTICKS			16
+
+#define SOFTUSB_SIM_MAX_PORTS			8
+#define SOFTUSB_SIM_MAX_PACKET			16
+#define SOFTUSB_SIM_MAX_WAVE			(SOFTUSB_SIM_MAX_PACKET * 10 + 8)
+#define SOFTUSB_SIM_REPORT_QUEUE		16
+#define SOFTUSB_SIM_MAX_ENDPOINTS		2
+
+// Device models
+#define SOFTUSB_SIM_NONE				0
+#define SOFTUSB_SIM_KEYBOARD			1
+#define SOFTUSB_SIM_MOUSE				2
+#define SOFTUSB_SIM_COMPOSITE			3
+#define SOFTUSB_SIM_HIRES_MOUSE			4
+#define SOFTUSB_SIM_GAMEPAD				5
+#define SOFTUSB_SIM_TABLET				6
+#define SOFTUSB_SIM_NKRO_KEYBOARD		7
+#define SOFTUSB_SIM_FULLSPEED			254
+
+// Answers to SET_IDLE and SET_PROTOCOL, see set_hid_requests()
+#define SOFTUSB_SIM_HID_ACCEPT			0
+#define SOFTUSB_SIM_HID_STALL			1
+#define SOFTUSB_SIM_HID_NO_SETUP		2
+
+// Line states
+#define SOFTUSB_SIM_SE0					0
+#define SOFTUSB_SIM_J					1
+#define SOFTUSB_SIM_K					2
+
+// Fault injection
+typedef struct
+{
+	// Probability of a flipped bit in each transmitted device bit, ppm
+	unsigned int bit_error_ppm;
+	// Device clock error, ppm (positive is slower)
+	int drift_ppm;
+	// Probability of a missing handshake after a host packet, percent
+	unsigned int drop_handshake_percent;
+	// Probability of a NAK instead of a ready report, percent
+	unsigned int nak_percent;
+	// Probability that the host ACK after a report is missed and the report
+	// is sent again with the same DATA PID, percent
+	unsigned int lost_ack_percent;
+} softusb_sim_faults_t;
+
+// Counters collected by the device model
+typedef struct
+{
+	unsigned int tokens;
+	unsigned int setups;
+	unsigned int ins;
+	unsigned int outs;
+	unsigned int naks;
+	unsigned int reports;
+	unsigned int crc_errors;
+	unsigned int resets;
+	unsigned int retransmits;
+} softusb_sim_stats_t;
+
+typedef struct
+{
+	unsigned char data[8];
+	int length;
+} softusb_sim_report_t;
+
+class SoftUsbSimBus
+{
+public:
+	SoftUsbSimBus();
+
+	// Host side, used by the platform macros
+	void attach_host(unsigned int mpin, unsigned int ppin);
+	void write(unsigned int bsrr);
+	void set_output(int output);
+	unsigned int read();
+
+	// Host side DMA (see SOFTUSB_DMA_TX and SOFTUSB_DMA_RX)
+	void dma_tx_start(const unsigned int *wave, int count);
+	int dma_tx_left();
+	void dma_rx_start(unsigned short *buffer, int count, unsigned int period);
+	int dma_rx_left();
+	void dma_rx_stop();
+
+	// Device side, used by simulations
+	void attach_device(int model);
+	void detach_device();
+	int add_report(int ep, const unsigned char *data, int length);
+	void set_faults(const softusb_sim_faults_t &faults);
+	const softusb_sim_stats_t *get_stats();
+	unsigned char get_address();
+	unsigned char get_leds();
+	unsigned char get_protocol(int intf);
+	unsigned char get_idle(int intf);
+	// Last SETUP packet acknowledged by the device
+	const unsigned char *get_setup();
+	// SET_IDLE and SET_PROTOCOL are accepted, STALLed in the status stage
+	// or their SETUP is not acknowledged (SOFTUSB_SIM_HID_*)
+	void set_hid_requests(int mode);
+
+	// Advance the bus by one simulation step
+	void step();
+
+private:
+	unsigned int _mmask;
+	unsigned int _pmask;
+	unsigned int _pins;
+	int _output;
+	int _model;
+	int _level;
+	softusb_sim_faults_t _faults;
+	int _hid_requests;
+	softusb_sim_stats_t _stats;
+	unsigned int _random;
+
+	// DMA
+	const unsigned int *_dma_tx_wave;
+	int _dma_tx_count;
+	unsigned long long _dma_tx_next;
+	unsigned short *_dma_rx_buffer;
+	int _dma_rx_count;
+	int _dma_rx_enabled;
+	unsigned long long _dma_rx_next;
+	unsigned long long _dma_rx_step;
+
+	// Descriptors
+	const unsigned char *_device_descr;
+	const unsigned char *_conf_descr;
+	int _conf_length;
+	const unsigned char *_report_descr[2];
+	int _report_length[2];
+
+	// Device state
+	unsigned char _address;
+	unsigned char _new_address;
+	unsigned char _configuration;
+	unsigned char _leds;
+	unsigned char _protocol[2];
+	unsigned char _idle[2];
+	unsigned int _se0;
+
+	// Receiver
+	int _rx_active;
+	int _rx_prev;
+	int _rx_last;
+	unsigned long long _rx_next;
+	int _rx_ones;
+	int _rx_bits;
+	int _rx_error;
+	unsigned char _rx[SOFTUSB_SIM_MAX_PACKET];
+
+	// Transmitter
+	unsigned char _tx_levels[SOFTUSB_SIM_MAX_WAVE];
+	int _tx_count;
+	int _tx_pos;
+	unsigned long long _tx_start;
+	int _tx_pending;
+
+	// Protocol
+	unsigned char _token;
+	unsigned char _token_ep;
+	int _token_valid;
+	unsigned char _setup[8];
+	int _setup_valid;
+	const unsigned char *_ctl_data;
+	int _ctl_length;
+	int _ctl_offset;
+	int _ctl_chunk;
+	int _ctl_toggle;
+	int _ctl_status;
+	int _awaiting_ack;
+	int _awaiting_ep;
+	softusb_sim_report_t _last_report[SOFTUSB_SIM_MAX_ENDPOINTS];
+	unsigned long long _last_report_time[SOFTUSB_SIM_MAX_ENDPOINTS];
+	softusb_sim_report_t _reports[SOFTUSB_SIM_MAX_ENDPOINTS][SOFTUSB_SIM_REPORT_QUEUE];
+	int _report_rp[SOFTUSB_SIM_MAX_ENDPOINTS];
+	int _report_wp[SOFTUSB_SIM_MAX_ENDPOINTS];
+	int _report_toggle[SOFTUSB_SIM_MAX_ENDPOINTS];
+
+	unsigned int period();
+	unsigned int random();
+	int percent(unsigned int value);
+	int line();
+	unsigned int sample();
+	void dma_step(unsigned long long now);
+	void reset_device();
+	void rx_start(unsigned long long now);
+	void rx_bit(int level);
+	void rx_packet();
+	void handle_setup();
+	void handle_in(int ep);
+	void handle_out(const unsigned char *data, int length);
+	void transmit(const unsigned char *data, int count);
+	void transmit_pid(unsigned char pid);
+	void transmit_data(unsigned char pid, const unsigned char *data, int count);
+};
+
+// Global simulation clock in SOFTUSB_SIM_SUBTICKS units
+unsigned int softusb_sim_timer();
+void softusb_sim_timer_sync();
+unsigned long long softusb_sim_time();
+void softusb_sim_run(unsigned long long steps);
+void softusb_sim_run_until(unsigned long long time);
+
+SoftUsbSimBus *softusb_sim_bus(unsigned int port);
@@ -0,0 +1,163 @@
+// Writes captures.h: line samples of low-speed packets as a DMA receiver
+// would record them, with device clock error and sampling phase.
+// Build: g++ -o make_captures tests/make_captures.cpp && ./make_captures > tests/captures.h
+
+#include <stdio.h>
+#include <math.h>
+
+// D- on pin 0, D+ on pin 1, J is D- high
+#define MMASK	1
+#define PMASK	2
+
+typedef struct
+{
+	const char *name;
+	const unsigned char *data;
+	int length;
+	// Samples per bit, 1/256 units
+	unsigned int period;
+	// Device clock error
+	int drift_ppm;
+	// First sample position in a bit, 1/256 units
+	int phase;
+} capture_t;
+
+static const unsigned char ack[] = {0x80, 0xD2};
+static const unsigned char nak[] = {0x80, 0x5A};
+
+// DATA1 and keyboard report, CRC is added at runtime
+static unsigned char report[12] = {0x80, 0x4B, 0x02, 0x00, 0x0B, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+// DATA0 with runs of ones for bit stuffing
+static unsigned char stuffed[12] = {0x80, 0xC3, 0xFF, 0xFF, 0x7F, 0x3F, 0xFE, 0x01, 0xFF, 0x80};
+
+static const capture_t captures[] =
+{
+	{"ack_3x", ack, sizeof(ack), 768, 0, 0},
+	{"nak_3x", nak, sizeof(nak), 768, 0, 128},
+	{"report_3x", report, 12, 768, 0, 64},
+	{"report_3x_fast", report, 12, 768, 10000, 200},
+	{"report_3x_slow", report, 12, 768, -10000, 32},
+	{"stuffed_3x", stuffed, 12, 768, 0, 128},
+	{"stuffed_3x_fast", stuffed, 12, 768, 10000, 0},
+	{"stuffed_3x_slow", stuffed, 12, 768, -10000, 240},
+	{"ack_1x5", ack, sizeof(ack), 384, 0, 64},
+	{"report_1x5", report, 12, 384, 0, 128},
+	{"report_1x5_fast", report, 12, 384, 1000, 64},
+	{"stuffed_1x5", stuffed, 12, 384, 0, 64},
+	{"stuffed_1x5_slow", stuffed, 12, 384, -1000, 128},
+};
+
+static unsigned short crc16(const unsigned char *data, int count)
+{
+	unsigned int crc = 0xFFFF;
+	int i, j;
+	
+	for (i = 0; i < count; i++)
+	{
+		crc ^= data[i];
+		
+		for (j = 0; j < 8; j++)
+		{
+			crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		}
+	}
+	
+	return ~crc & 0xFFFF;
+}
+
+// Line level of every bit: NRZI, stuffing and EOP
+static int levels(const unsigned char *data, int length, unsigned char *out)
+{
+	int i, j, n = 0, ones = 0;
+	unsigned char level = MMASK;
+	
+	for (i = 0; i < length; i++)
+	{
+		for (j = 0; j < 8; j++)
+		{
+			if (data[i] & (1 << j))
+			{
+				ones++;
+			}
+			else
+			{
+				level ^= MMASK | PMASK;
+				ones = 0;
+			}
+			
+			out[n++] = level;
+			
+			if (ones == 6)
+			{
+				level ^= MMASK | PMASK;
+				out[n++] = level;
+				ones = 0;
+			}
+		}
+	}
+	
+	out[n++] = 0;
+	out[n++] = 0;
+	out[n++] = MMASK;
+	
+	return n;
+}
+
+int main()
+{
+	unsigned char bits[256];
+	unsigned short crc;
+	int i, k, n, count;
+	double t, bit;
+	
+	crc = crc16(&report[2], 8);
+	report[10] = crc & 0xFF;
+	report[11] = crc >> 8;
+	crc = crc16(&stuffed[2], 8);
+	stuffed[10] = crc & 0xFF;
+	stuffed[11] = crc >> 8;
+	
+	printf("// Generated by make_captures.cpp, do not edit\n\n");
+	printf("#define CAPTURE_MMASK\t%d\n#define CAPTURE_PMASK\t%d\n\n", MMASK, PMASK);
+	
+	for (i = 0; i < (int)(sizeof(captures) / sizeof(captures[0])); i++)
+	{
+		const capture_t *c = &captures[i];
+		
+		n = levels(c->data, c->length, bits);
+		
+		// Idle J before the packet and after EOP
+		count = (int)((n + 4) * c->period / 256.0) + 8;
+		
+		printf("static const unsigned char %s_data[] = {", c->name);
+		for (k = 0; k < c->length; k++)
+		{
+			printf("%s0x%02X", k ? ", " : "", c->data[k]);
+		}
+		printf("};\n");
+		
+		printf("static const softusb_sample_t %s_samples[] =\n{", c->name);
+		for (k = 0; k < count; k++)
+		{
+			// Packet starts 2 bits after the first sample
+			t = (k * 256.0 + c->phase) / c->period - 2;
+			bit = floor(t / (1.0 + c->drift_ppm / 1e6));
+			
+			printf("%s%s%d", k ? "," : "", k % 32 ? " " : "\n\t", bit < 0 || bit >= n ? MMASK : bits[(int)bit]);
+		}
+		printf("\n};\n\n");
+	}
+	
+	printf("static const capture_t captures[] =\n{\n");
+	for (i = 0; i < (int)(sizeof(captures) / sizeof(captures[0])); i++)
+	{
+		const capture_t *c = &captures[i];
+		
+		printf("\t{\"%s\", %s_samples, sizeof(%s_samples) / sizeof(softusb_sample_t), %u, %s_data, sizeof(%s_data)},\n",
+			c->name, c->name, c->name, c->period, c->name, c->name);
+	}
+	printf("};\n");
+	
+	return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Build and run host tests with the simulated platform
+# Usage: tests/run_tests.sh [output directory]
+
+set -e
+
+cd "$(dirname "$0")/.."
+OUT=${1:-/tmp/softusb_tests}
+CXX=${CXX:-g++}
+CXXFLAGS="-std=gnu++11 -O2 -Wall -DSOFTUSB_PLATFORM_HOST -I. -Itests"
+SRC="softusb.cpp softusb_sim.cpp"
+
+mkdir -p "$OUT"
+
+# name, extra flags, source
+build()
+{
+	$CXX $CXXFLAGS $2 $SRC "tests/$3" -o "$OUT/$1" -lpthread
+	"$OUT/$1"
+}
+
+build test_decode "" test_decode.cpp
+build test_dma_tx "-DSOFTUSB_DMA_TX" test_dma_tx.cpp
+build test_dma_tx_rx "-DSOFTUSB_DMA_TX -DSOFTUSB_DMA_RX" test_dma_tx.cpp
+build test_ring "" test_ring.cpp
+build test_trace "-DSOFTUSB_TRACE" test_trace.cpp
+build test_cache "-fsanitize=address -fno-sanitize-recover=all" test_cache.cpp
+build test_budget "" test_budget.cpp
+build test_output_report "" test_output_report.cpp
+build test_report_plan "" test_report_plan.cpp
+build test_raw_report "" test_raw_report.cpp
+build test_composite "" test_composite.cpp
+build test_mouse "-fsanitize=undefined -fno-sanitize-recover=all" test_mouse.cpp
+build test_backoff "" test_backoff.cpp
+build test_toggle "" test_toggle.cpp
+build test_keyboard "" test_keyboard.cpp
+build test_hid_requests "" test_hid_requests.cpp
@@ -0,0 +1,77 @@
+// Minimal checks and simulator fixture for host tests
+#pragma once
+
+#include <stdio.h>
+#include "softusb.h"
+
+static int test_failures = 0;
+
+#define CHECK(cond)	\
+	do	\
+	{	\
+		if (!(cond))	\
+		{	\
+			printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);	\
+			test_failures++;	\
+		}	\
+	} while (0)
+
+// Print result, returns exit code
+static inline int test_result(const char *name)
+{
+	printf("%s: %s\n", name, test_failures ? "FAILED" : "OK");
+	
+	return test_failures != 0;
+}
+
+// Simulation steps in 1 ms
+#define TEST_FRAME_STEPS	(1500ull * SOFTUSB_SIM_SUBTICKS)
+
+// Frames to wait for enumeration of a simulated device
+#define TEST_ENUM_FRAMES	3000
+
+// Run the bus to the start of the next 1 ms frame
+static inline void test_frame()
+{
+	softusb_sim_run_until((softusb_sim_time() / TEST_FRAME_STEPS + 1) * TEST_FRAME_STEPS);
+}
+
+// Call timer1ms() of the port in each frame
+static inline void test_run(SoftUsb &usb, int frames)
+{
+	int i;
+	
+	for (i = 0; i < frames; i++)
+	{
+		test_frame();
+		usb.timer1ms();
+	}
+}
+
+// Attach a device model and run the port until it works,
+// returns number of frames or -1
+static inline int test_enumerate(SoftUsb &usb, SoftUsbSimBus *bus, int model)
+{
+	int i;
+	
+	bus->attach_device(model);
+	
+	for (i = 0; i < TEST_ENUM_FRAMES; i++)
+	{
+		if (usb.get_state() == su_work)
+		{
+			return i;
+		}
+		
+		test_run(usb, 1);
+	}
+	
+	return -1;
+}
+
+// Detach the device and run the port until it notices
+static inline void test_detach(SoftUsb &usb, SoftUsbSimBus *bus)
+{
+	bus->detach_device();
+	test_run(usb, 200);
+}
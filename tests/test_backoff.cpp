@@ -0,0 +1,80 @@
+// Idle backoff: poll interval doubles after a run of NAKs up to the ceiling
+// and returns to the endpoint interval with the next report
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_backoff.cpp -lpthread
+
+#include "softusb.h"
+#include "test.h"
+
+#define ENDPOINT_INTERVAL	10
+
+class TestUsb : public SoftUsb
+{
+public:
+	TestUsb() : SoftUsb(0, 0, 1) {}
+	
+	int get_interval()
+	{
+		return _endpoints[0].interval;
+	}
+};
+
+// Run until the interval changes, returns NAKs of the idle device meanwhile
+static unsigned int run_interval(TestUsb &usb, int frames)
+{
+	unsigned int naks = usb.get_poll_stats()->naks;
+	int interval = usb.get_interval();
+	int i;
+	
+	for (i = 0; i < frames && usb.get_interval() == interval; i++)
+	{
+		test_run(usb, 1);
+	}
+	
+	return usb.get_poll_stats()->naks - naks;
+}
+
+int main()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	TestUsb usb;
+	unsigned char report[4] = {0, 1, 1, 0};
+	unsigned int naks;
+	
+	usb.set_idle_backoff(4, 40);
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_MOUSE) >= 0);
+	CHECK(usb.get_interval() == ENDPOINT_INTERVAL);
+	
+	// Doubled after every 4 NAKs: 10, 20, 40 ms
+	CHECK(run_interval(usb, 1000) == 4);
+	CHECK(usb.get_interval() == 20);
+	CHECK(run_interval(usb, 1000) == 4);
+	CHECK(usb.get_interval() == 40);
+	
+	// Ceiling holds: 1 s of 40 ms polls
+	naks = run_interval(usb, 1000);
+	CHECK(usb.get_interval() == 40);
+	CHECK(naks >= 24 && naks <= 26);
+	
+	// A report brings the endpoint interval back
+	bus->add_report(1, report, 4);
+	test_run(usb, 50);
+	CHECK(usb.get_poll_stats()->reports == 1);
+	CHECK(usb.get_interval() == ENDPOINT_INTERVAL);
+	
+	// Ceiling below the endpoint interval is not used
+	usb.set_idle_backoff(4, 5);
+	test_run(usb, 500);
+	CHECK(usb.get_interval() == ENDPOINT_INTERVAL);
+	
+	// Disabled
+	usb.set_idle_backoff(0, 40);
+	usb.reset_poll_stats();
+	test_run(usb, 500);
+	CHECK(usb.get_interval() == ENDPOINT_INTERVAL);
+	CHECK(usb.get_poll_stats()->naks >= 49);
+	
+	test_detach(usb, bus);
+	
+	return test_result("test_backoff");
+}
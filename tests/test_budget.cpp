@@ -0,0 +1,92 @@
+// Time of one timer1ms() call stays within the control budget of a port
+// and within the budget of SoftUsbHost
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_budget.cpp -lpthread
+
+#include "softusb.h"
+#include "test.h"
+
+#define PORTS			4
+#define HOST_BUDGET		300
+
+// Enumerate a keyboard on its own, returns the longest frame
+static unsigned int test_port(unsigned int port, int control_budget)
+{
+	SoftUsb usb(port, 0, 1);
+	unsigned int worst = 0;
+	int i;
+	
+	if (control_budget >= 0)
+	{
+		usb.set_control_budget(control_budget);
+	}
+	
+	softusb_sim_bus(port)->attach_device(SOFTUSB_SIM_KEYBOARD);
+	
+	for (i = 0; i < TEST_ENUM_FRAMES && usb.get_state() != su_work; i++)
+	{
+		test_run(usb, 1);
+		
+		if (usb.get_frame_ticks() > worst)
+		{
+			worst = usb.get_frame_ticks();
+		}
+	}
+	
+	CHECK(usb.get_state() == su_work);
+	
+	return worst;
+}
+
+static void test_host()
+{
+	SoftUsb usb0(4, 0, 1), usb1(5, 0, 1), usb2(6, 0, 1), usb3(7, 0, 1);
+	SoftUsb *usb[PORTS] = {&usb0, &usb1, &usb2, &usb3};
+	SoftUsbHost host(HOST_BUDGET);
+	unsigned int spent, worst = 0;
+	int i, k, all = 0;
+	
+	for (i = 0; i < PORTS; i++)
+	{
+		// Host budget applies instead
+		usb[i]->set_control_budget(0);
+		host.add_port(usb[i]);
+		softusb_sim_bus(4 + i)->attach_device(i % 2 ? SOFTUSB_SIM_MOUSE : SOFTUSB_SIM_KEYBOARD);
+	}
+	
+	for (k = 0; k < TEST_ENUM_FRAMES && !all; k++)
+	{
+		test_frame();
+		host.timer1ms();
+		
+		spent = 0;
+		all = 1;
+		
+		for (i = 0; i < PORTS; i++)
+		{
+			spent += usb[i]->get_frame_ticks();
+			all &= usb[i]->get_state() == su_work;
+		}
+		
+		if (spent > worst)
+		{
+			worst = spent;
+		}
+	}
+	
+	// Leftover budget goes to control stages but the sum never exceeds it
+	CHECK(all);
+	CHECK(worst == HOST_BUDGET);
+}
+
+int main()
+{
+	// Stages fill the frame by default, a budget splits them
+	CHECK(test_port(0, -1) > 3 * SOFTUSB_TRANSACTION_TICKS);
+	CHECK(test_port(1, 0) <= SOFTUSB_CONTROL_FRAME_TICKS);
+	CHECK(test_port(2, SOFTUSB_TRANSACTION_TICKS) == SOFTUSB_TRANSACTION_TICKS);
+	CHECK(test_port(3, 3 * SOFTUSB_TRANSACTION_TICKS) == 3 * SOFTUSB_TRANSACTION_TICKS);
+	
+	test_host();
+	
+	return test_result("test_budget");
+}
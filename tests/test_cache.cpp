@@ -0,0 +1,138 @@
+// SoftUsbCache: blob save and load, enumeration from a loaded cache
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_cache.cpp -lpthread
+
+#include "softusb.h"
+#include "test.h"
+
+// Returns tokens sent until the device works
+static unsigned int enumerate(SoftUsb &usb, SoftUsbSimBus *bus, int model)
+{
+	unsigned int tokens;
+	
+	CHECK(test_enumerate(usb, bus, model) >= 0);
+	
+	tokens = bus->get_stats()->tokens;
+	
+	test_detach(usb, bus);
+	
+	return tokens;
+}
+
+static void set_crc(unsigned char *blob, int n)
+{
+	unsigned short crc = softusb_crc16(blob, n - 2);
+	
+	blob[n - 2] = crc & 0xFF;
+	blob[n - 1] = crc >> 8;
+}
+
+// Record size: VID, PID, bcdDevice, counts, stamp, configuration descriptor,
+// interfaces, endpoints and fields
+static int record_size(int interfaces, int endpoints, int fields)
+{
+	return 22 + interfaces * 16 + endpoints * 8 + fields * 11;
+}
+
+// Valid blob of one zero-filled entry, returns its size
+static int make_blob(unsigned char *blob, int interfaces, int endpoints, int fields)
+{
+	int record = record_size(interfaces, endpoints, fields);
+	int n = 8 + 2 + record + 2;
+	int i;
+	
+	for (i = 0; i < n; i++)
+	{
+		blob[i] = 0;
+	}
+	
+	blob[0] = 'S';
+	blob[1] = 'U';
+	blob[2] = 'C';
+	blob[3] = SOFTUSB_CACHE_VERSION;
+	blob[4] = 1;
+	blob[8] = record & 0xFF;
+	blob[9] = record >> 8;
+	blob[16] = interfaces;
+	blob[17] = endpoints;
+	blob[18] = fields;
+	// Stamp
+	blob[19] = 1;
+	set_crc(blob, n);
+	
+	return n;
+}
+
+static int record_of(SoftUsbCache &cache, unsigned short device_id)
+{
+	const softusb_cache_entry_t *e = cache.find(0x1209, device_id, 0x0100);
+	
+	CHECK(e != 0);
+	
+	return e ? 2 + record_size(e->interface_count, e->endpoint_count, e->field_count) : 0;
+}
+
+int main()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsbCache cache, loaded;
+	SoftUsb usb(0, 0, 1);
+	unsigned char blob[16384];
+	unsigned int full, cached;
+	unsigned char move[4] = {1, 5, 0xFD, 1};
+	int dx, dy, dwheel, buttons;
+	int n;
+	
+	usb.set_cache(&cache);
+	enumerate(usb, bus, SOFTUSB_SIM_KEYBOARD);
+	full = enumerate(usb, bus, SOFTUSB_SIM_MOUSE);
+	
+	n = cache.save(blob, sizeof(blob));
+	CHECK(n == cache.get_blob_size());
+	CHECK(n == 8 + record_of(cache, 1) + record_of(cache, 2) + 2);
+	CHECK(cache.save(blob, n - 1) == 0);
+	CHECK(loaded.load(blob, n) == 2);
+	CHECK(loaded.load(blob, n - 1) == -1);
+	
+	// CRC
+	blob[20] ^= 1;
+	CHECK(loaded.load(blob, n) == -1);
+	blob[20] ^= 1;
+	
+	// Version
+	blob[3]++;
+	set_crc(blob, n);
+	CHECK(loaded.load(blob, n) == -1);
+	blob[3]--;
+	
+	// Entry size of the first record
+	blob[8]++;
+	set_crc(blob, n);
+	CHECK(loaded.load(blob, n) == -1);
+	blob[8]--;
+	set_crc(blob, n);
+	
+	// Tables larger than this build keeps
+	CHECK(loaded.load(blob, make_blob(blob, SOFTUSB_MAX_INTERFACES, SOFTUSB_MAX_ENDPOINTS, SOFTUSB_MAX_FIELDS)) == 1);
+	CHECK(loaded.load(blob, make_blob(blob, SOFTUSB_MAX_INTERFACES + 1, 1, 0)) == -1);
+	CHECK(loaded.load(blob, make_blob(blob, 1, SOFTUSB_MAX_ENDPOINTS + 1, 0)) == -1);
+	CHECK(loaded.load(blob, make_blob(blob, 1, 1, SOFTUSB_MAX_FIELDS + 1)) == -1);
+	CHECK(loaded.load(blob, make_blob(blob, 255, 255, 255)) == -1);
+	
+	// Loaded cache skips configuration and report descriptors
+	n = cache.save(blob, sizeof(blob));
+	CHECK(loaded.load(blob, n) == 2);
+	usb.set_cache(&loaded);
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_MOUSE) >= 0);
+	cached = bus->get_stats()->tokens;
+	CHECK(cached < full);
+	
+	// Report plan is the same
+	bus->add_report(1, move, 4);
+	test_run(usb, 50);
+	usb.consume_mouse_deltas(dx, dy, dwheel, buttons);
+	CHECK(dx == 5 && dy == -3 && dwheel == 1 && buttons == 1);
+	test_detach(usb, bus);
+	
+	return test_result("test_cache");
+}
@@ -0,0 +1,63 @@
+// Keyboard and mouse interfaces of one device: full configuration
+// descriptor, both endpoints polled and decoded
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_composite.cpp -lpthread
+
+#include "softusb.h"
+#include "test.h"
+
+int main()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	const usb_configuration_descriptor_t *conf;
+	int dx, dy, dwheel, buttons;
+	unsigned char h[8] = {0, 0, 0x0B, 0, 0, 0, 0, 0};
+	unsigned char none[8] = {0};
+	unsigned char move[4] = {1, 5, 0xFD, 0};
+	int i;
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_COMPOSITE) >= 0);
+	CHECK(usb.get_device_type() == USB_DEVICE_COMPOSITE);
+	
+	// 59 bytes of configuration descriptor read in 8-byte packets
+	conf = usb.get_conf_descriptor();
+	CHECK(conf->total_length[0] == 59 && conf->total_length[1] == 0);
+	CHECK(conf->num_interfaces == 2);
+	
+	CHECK(usb.get_interface_count() == 2);
+	CHECK(usb.get_interface_type(0) == USB_DEVICE_KEYBOARD);
+	CHECK(usb.get_interface_type(1) == USB_DEVICE_MOUSE);
+	CHECK(usb.get_interface_descriptor(1)->interface_number == 1);
+	
+	CHECK(usb.get_endpoint_count() == 2);
+	CHECK(usb.get_endpoint_descriptor(0)->endpoint_address == 0x81);
+	CHECK(usb.get_endpoint_descriptor(1)->endpoint_address == 0x82);
+	
+	// Reports of both interfaces at the same time
+	for (i = 0; i < 3; i++)
+	{
+		bus->add_report(1, h, 8);
+		bus->add_report(1, none, 8);
+		bus->add_report(2, move, 4);
+	}
+	
+	test_run(usb, 200);
+	
+	for (i = 0; i < 3; i++)
+	{
+		CHECK(usb.kbhit() && usb.getch() == 'h');
+	}
+	
+	CHECK(!usb.kbhit());
+	
+	usb.consume_mouse_deltas(dx, dy, dwheel, buttons);
+	CHECK(dx == 15);
+	CHECK(dy == -9);
+	CHECK(buttons == 1);
+	CHECK(usb.get_poll_stats()->reports == 9);
+	
+	test_detach(usb, bus);
+	CHECK(usb.get_device_type() == USB_DEVICE_NOT_CONNECTED);
+	
+	return test_result("test_composite");
+}
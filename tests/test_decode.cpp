@@ -0,0 +1,149 @@
+// softusb_decode on captures from make_captures.cpp at 3x and 1.5x sampling
+// and on random packets with clock drift
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_decode.cpp -lpthread
+
+#include <stdlib.h>
+#include <string.h>
+#include "softusb.h"
+#include "test.h"
+
+typedef struct
+{
+	const char *name;
+	const softusb_sample_t *samples;
+	int count;
+	unsigned int period;
+	const unsigned char *data;
+	int length;
+} capture_t;
+
+#include "captures.h"
+
+// Line levels of a packet, same coding as the generator
+static int levels(const unsigned char *data, int length, softusb_sample_t *out)
+{
+	int i, j, n = 0, ones = 0;
+	softusb_sample_t level = CAPTURE_MMASK;
+	
+	for (i = 0; i < length; i++)
+	{
+		for (j = 0; j < 8; j++)
+		{
+			if (data[i] & (1 << j))
+			{
+				ones++;
+			}
+			else
+			{
+				level ^= CAPTURE_MMASK | CAPTURE_PMASK;
+				ones = 0;
+			}
+			
+			out[n++] = level;
+			
+			if (ones == 6)
+			{
+				level ^= CAPTURE_MMASK | CAPTURE_PMASK;
+				out[n++] = level;
+				ones = 0;
+			}
+		}
+	}
+	
+	out[n++] = 0;
+	out[n++] = 0;
+	out[n++] = CAPTURE_MMASK;
+	
+	return n;
+}
+
+static void test_captures()
+{
+	unsigned char buffer[16];
+	int i, n;
+	
+	for (i = 0; i < (int)(sizeof(captures) / sizeof(captures[0])); i++)
+	{
+		const capture_t *c = &captures[i];
+		
+		n = softusb_decode(c->samples, c->count, c->period, CAPTURE_MMASK, CAPTURE_PMASK, buffer, sizeof(buffer));
+		
+		if (n != c->length || memcmp(buffer, c->data, c->length) != 0)
+		{
+			printf("capture %s: decoded %d bytes\n", c->name, n);
+		}
+		
+		CHECK(n == c->length);
+		CHECK(memcmp(buffer, c->data, c->length) == 0);
+		
+		// Data packets carry a valid CRC16
+		if (c->length > 4)
+		{
+			CHECK((softusb_crc16(&buffer[2], n - 2) ^ 0xFFFFu) == 0xB001);
+		}
+	}
+}
+
+// Random packets at a random phase. 3x sampling holds the whole +-1.5%
+// low-speed clock tolerance, 1.5x only an accurate clock
+static void test_drift(unsigned int period, int max_drift_ppm)
+{
+	softusb_sample_t bits[160], samples[600];
+	unsigned char data[12], buffer[16];
+	int i, k, n, length, count, bit, failed = 0;
+	double drift, t;
+	
+	srand(period);
+	
+	for (i = 0; i < 5000; i++)
+	{
+		length = 2 + rand() % 11;
+		data[0] = 0x80;
+		
+		for (k = 1; k < length; k++)
+		{
+			data[k] = rand() % 3 ? rand() : 0xFF;
+		}
+		
+		n = levels(data, length, bits);
+		drift = (rand() % (2 * max_drift_ppm + 1) - max_drift_ppm) / 1e6;
+		t = -2 - (rand() % 256 + 0.5) / 256;
+		count = 0;
+		
+		while (count < (int)(sizeof(samples) / sizeof(samples[0])))
+		{
+			bit = t < 0 ? -1 : (int)(t / (1 + drift));
+			
+			if (bit >= n + 2)
+			{
+				break;
+			}
+			
+			samples[count++] = bit < 0 || bit >= n ? CAPTURE_MMASK : bits[bit];
+			t += 256.0 / period;
+		}
+		
+		k = softusb_decode(samples, count, period, CAPTURE_MMASK, CAPTURE_PMASK, buffer, sizeof(buffer));
+		
+		if (k != length || memcmp(buffer, data, length) != 0)
+		{
+			failed++;
+		}
+	}
+	
+	if (failed)
+	{
+		printf("period %u drift %d ppm: %d packets failed\n", period, max_drift_ppm, failed);
+	}
+	
+	CHECK(failed == 0);
+}
+
+int main()
+{
+	test_captures();
+	test_drift(768, 15000);
+	test_drift(384, 0);
+	
+	return test_result("test_decode");
+}
@@ -0,0 +1,52 @@
+// Enumeration, keyboard reports and LED output through the DMA transmitter
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -DSOFTUSB_DMA_TX -I. softusb.cpp softusb_sim.cpp tests/test_dma_tx.cpp -lpthread
+
+#include <stdlib.h>
+#include "softusb.h"
+#include "test.h"
+
+#ifndef SOFTUSB_DMA_TX
+#error "Build with SOFTUSB_DMA_TX"
+#endif
+
+static void test_keyboard(int drift_ppm)
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	softusb_sim_faults_t faults = {0, drift_ppm, 0, 0, 0};
+	unsigned char h[8] = {0, 0, 0x0B, 0, 0, 0, 0, 0};
+	unsigned char caps[8] = {0, 0, 0x39, 0, 0, 0, 0, 0};
+	unsigned char none[8] = {0};
+	
+	bus->set_faults(faults);
+	
+	// Every host packet went out through DMA and arrived intact
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_KEYBOARD) >= 0);
+	CHECK(usb.get_device_type() == USB_DEVICE_KEYBOARD);
+	CHECK(bus->get_address() != 0);
+	CHECK(bus->get_stats()->crc_errors == 0);
+	
+	bus->add_report(1, h, 8);
+	bus->add_report(1, none, 8);
+	bus->add_report(1, caps, 8);
+	bus->add_report(1, none, 8);
+	
+	test_run(usb, 200);
+	
+	// Caps Lock is sent back with SET_REPORT and a DATA0 OUT packet
+	CHECK(usb.kbhit() && usb.getch() == 'h');
+	CHECK(usb.get_lock_state() == KEYBOARD_LOCK_CAPS);
+	CHECK(bus->get_leds() == KEYBOARD_LOCK_CAPS);
+	CHECK(bus->get_stats()->crc_errors == 0);
+	
+	test_detach(usb, bus);
+}
+
+int main()
+{
+	test_keyboard(0);
+	test_keyboard(2000);
+	test_keyboard(-2000);
+	
+	return test_result("test_dma_tx");
+}
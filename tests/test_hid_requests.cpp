@@ -0,0 +1,116 @@
+// SET_PROTOCOL and SET_IDLE after the report descriptors: request bytes,
+// devices that STALL them or don't acknowledge their SETUP
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_hid_requests.cpp -lpthread
+
+#include <string.h>
+#include "softusb.h"
+#include "test.h"
+
+static void check_setup(SoftUsbSimBus *bus, const unsigned char *request)
+{
+	CHECK(memcmp(bus->get_setup(), request, 8) == 0);
+}
+
+// Key press is decoded after enumeration
+static void check_keyboard(SoftUsb &usb, SoftUsbSimBus *bus)
+{
+	unsigned char h[8] = {0, 0, 0x0B, 0, 0, 0, 0, 0};
+	unsigned char none[8] = {0};
+	
+	bus->add_report(1, h, 8);
+	bus->add_report(1, none, 8);
+	test_run(usb, 50);
+	
+	CHECK(usb.kbhit() && usb.getch() == 'h');
+}
+
+// SET_IDLE to keyboards only, SET_PROTOCOL to boot interfaces when needed
+static void test_requests()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	const unsigned char idle_0[8] = {0x21, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	const unsigned char idle_25[8] = {0x21, 0x0A, 0x00, 25, 0x00, 0x00, 0x00, 0x00};
+	const unsigned char boot_1[8] = {0x21, 0x0B, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00};
+	
+	// Report protocol is already set after reset
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_KEYBOARD) >= 0);
+	check_setup(bus, idle_0);
+	CHECK(bus->get_idle(0) == 0);
+	CHECK(bus->get_protocol(0) == 1);
+	test_detach(usb, bus);
+	
+	usb.set_idle_rate(25);
+	usb.set_hid_protocol(SOFTUSB_PROTOCOL_BOOT);
+	
+	// Mouse interface is the last one
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_COMPOSITE) >= 0);
+	check_setup(bus, boot_1);
+	CHECK(bus->get_protocol(0) == 0);
+	CHECK(bus->get_protocol(1) == 0);
+	CHECK(bus->get_idle(0) == 25);
+	CHECK(bus->get_idle(1) == 0);
+	test_detach(usb, bus);
+	
+	// SET_IDLE goes after SET_PROTOCOL
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_KEYBOARD) >= 0);
+	check_setup(bus, idle_25);
+	CHECK(bus->get_protocol(0) == 0);
+	check_keyboard(usb, bus);
+	test_detach(usb, bus);
+	
+	usb.set_idle_rate(SOFTUSB_DEFAULT_IDLE_RATE);
+	usb.set_hid_protocol(SOFTUSB_PROTOCOL_AUTO);
+}
+
+// Requests are optional, the device is used without them.
+// A STALL answers the request, it is not retried
+static void test_unsupported(int mode)
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb ref(0, 0, 1);
+	SoftUsb usb(0, 0, 1);
+	unsigned int setups;
+	int frames, n;
+	
+	// Same port with a device that accepts the requests
+	ref.set_hid_protocol(SOFTUSB_PROTOCOL_BOOT);
+	frames = test_enumerate(ref, bus, SOFTUSB_SIM_KEYBOARD);
+	CHECK(frames >= 0);
+	setups = bus->get_stats()->setups;
+	test_detach(ref, bus);
+	
+	usb.set_hid_protocol(SOFTUSB_PROTOCOL_BOOT);
+	
+	bus->set_hid_requests(mode);
+	
+	n = test_enumerate(usb, bus, SOFTUSB_SIM_KEYBOARD);
+	CHECK(n >= 0);
+	CHECK(bus->get_stats()->resets == 1);
+	CHECK(bus->get_protocol(0) == 1);
+	CHECK(bus->get_idle(0) == 125);
+	check_keyboard(usb, bus);
+	
+	// SETUPs without ACK are not counted by the device
+	if (mode == SOFTUSB_SIM_HID_STALL)
+	{
+		CHECK(n <= frames + 5);
+		CHECK(bus->get_stats()->setups == setups);
+	}
+	else
+	{
+		CHECK(bus->get_stats()->setups == setups - 2);
+	}
+	
+	test_detach(usb, bus);
+	bus->set_hid_requests(SOFTUSB_SIM_HID_ACCEPT);
+}
+
+int main()
+{
+	test_requests();
+	test_unsupported(SOFTUSB_SIM_HID_STALL);
+	test_unsupported(SOFTUSB_SIM_HID_NO_SETUP);
+	
+	return test_result("test_hid_requests");
+}
@@ -0,0 +1,161 @@
+// Keyboard state bitmap: press and release codes of boot (6KRO) and bitmap
+// (NKRO) reports, ErrorRollOver, lock keys and their LEDs
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_keyboard.cpp -lpthread
+
+#include <string.h>
+#include "softusb.h"
+#include "test.h"
+
+// Key codes and characters since the previous call
+static void check_keys(SoftUsb &usb, const unsigned char *codes, int count, const char *chars)
+{
+	unsigned char read[KEYBOARD_BUFFER_SIZE];
+	int n;
+	
+	n = usb.read_key_codes(read, KEYBOARD_BUFFER_SIZE);
+	CHECK(n == count);
+	CHECK(n == count && memcmp(read, codes, count) == 0);
+	
+	while (*chars)
+	{
+		CHECK(usb.kbhit() && usb.getch() == *chars);
+		chars++;
+	}
+	
+	CHECK(!usb.kbhit());
+}
+
+static void send(SoftUsb &usb, SoftUsbSimBus *bus, const unsigned char *report)
+{
+	bus->add_report(1, report, 8);
+	test_run(usb, 30);
+}
+
+// Boot reports: key arrays in any order, 6 keys at once
+static void test_boot()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	unsigned char af[8] = {0, 0, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09};
+	unsigned char acdf[8] = {0, 0, 0x09, 0x04, 0x06, 0x07, 0, 0};
+	unsigned char rollover[8] = {0, 0, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01};
+	unsigned char shift_g[8] = {0x02, 0, 0x0A, 0, 0, 0, 0, 0};
+	unsigned char none[8] = {0};
+	const unsigned char pressed[6] = {0x1E, 0x30, 0x2E, 0x20, 0x12, 0x21};
+	const unsigned char released_be[2] = {0xB0, 0x92};
+	const unsigned char released[4] = {0x9E, 0xAE, 0xA0, 0xA1};
+	const unsigned char g[2] = {0x22, 0xA2};
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_KEYBOARD) >= 0);
+	
+	send(usb, bus, af);
+	check_keys(usb, pressed, 6, "abcdef");
+	
+	// B and E released, the rest only moved in the array
+	send(usb, bus, acdf);
+	check_keys(usb, released_be, 2, "");
+	
+	// Too many keys, state is kept
+	send(usb, bus, rollover);
+	check_keys(usb, none, 0, "");
+	
+	send(usb, bus, none);
+	check_keys(usb, released, 4, "");
+	
+	// Modifiers are not keys
+	send(usb, bus, shift_g);
+	send(usb, bus, none);
+	check_keys(usb, g, 2, "G");
+	
+	test_detach(usb, bus);
+}
+
+// Bitmap reports: any number of keys
+static void test_nkro()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	// A..J, usages 0x04..0x0D
+	unsigned char aj[8] = {0, 0xFF, 0x03, 0, 0, 0, 0, 0};
+	// C and I released, 1 (0x1E) pressed
+	unsigned char next[8] = {0, 0xFB, 0x02, 0, 0x04, 0, 0, 0};
+	unsigned char none[8] = {0};
+	const unsigned char pressed[10] = {0x1E, 0x30, 0x2E, 0x20, 0x12, 0x21, 0x22, 0x23, 0x17, 0x24};
+	const unsigned char changed[3] = {0xAE, 0x97, 0x02};
+	const unsigned char released[9] = {0x9E, 0xB0, 0xA0, 0x92, 0xA1, 0xA2, 0xA3, 0xA4, 0x82};
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_NKRO_KEYBOARD) >= 0);
+	CHECK(usb.get_device_type() == USB_DEVICE_KEYBOARD);
+	
+	send(usb, bus, aj);
+	check_keys(usb, pressed, 10, "abcdefghij");
+	
+	send(usb, bus, next);
+	check_keys(usb, changed, 3, "1");
+	
+	send(usb, bus, none);
+	check_keys(usb, released, 9, "");
+	
+	test_detach(usb, bus);
+}
+
+// Lock keys toggle on press, held keys don't toggle again
+static void test_locks()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	unsigned char caps[8] = {0, 0, 0x39, 0, 0, 0, 0, 0};
+	unsigned char caps_a[8] = {0, 0, 0x39, 0x04, 0, 0, 0, 0};
+	unsigned char num[8] = {0, 0, 0x53, 0, 0, 0, 0, 0};
+	unsigned char scroll[8] = {0, 0, 0x47, 0, 0, 0, 0, 0};
+	unsigned char a[8] = {0, 0, 0x04, 0, 0, 0, 0, 0};
+	unsigned char none[8] = {0};
+	unsigned char codes[KEYBOARD_BUFFER_SIZE];
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_KEYBOARD) >= 0);
+	CHECK(usb.get_lock_state() == 0);
+	
+	send(usb, bus, caps);
+	send(usb, bus, caps_a);
+	send(usb, bus, none);
+	CHECK(usb.get_lock_state() == KEYBOARD_LOCK_CAPS);
+	CHECK(bus->get_leds() == KEYBOARD_LOCK_CAPS);
+	CHECK(usb.getch() == 'A');
+	
+	send(usb, bus, num);
+	send(usb, bus, none);
+	CHECK(usb.get_lock_state() == (KEYBOARD_LOCK_NUM | KEYBOARD_LOCK_CAPS));
+	CHECK(bus->get_leds() == (KEYBOARD_LOCK_NUM | KEYBOARD_LOCK_CAPS));
+	
+	// Caps Lock off again
+	send(usb, bus, caps);
+	send(usb, bus, none);
+	send(usb, bus, a);
+	send(usb, bus, none);
+	CHECK(usb.get_lock_state() == KEYBOARD_LOCK_NUM);
+	CHECK(usb.getch() == 'a');
+	
+	send(usb, bus, scroll);
+	send(usb, bus, none);
+	CHECK(usb.get_lock_state() == (KEYBOARD_LOCK_NUM | KEYBOARD_LOCK_SCROLL));
+	CHECK(bus->get_leds() == (KEYBOARD_LOCK_NUM | KEYBOARD_LOCK_SCROLL));
+	
+	// Set by the application
+	usb.set_lock_state(0);
+	test_run(usb, 30);
+	CHECK(bus->get_leds() == 0);
+	
+	usb.read_key_codes(codes, KEYBOARD_BUFFER_SIZE);
+	CHECK(!usb.kbhit());
+	
+	test_detach(usb, bus);
+}
+
+int main()
+{
+	test_boot();
+	test_nkro();
+	test_locks();
+	
+	return test_result("test_keyboard");
+}
@@ -0,0 +1,83 @@
+// Mouse state snapshot and movement since the previous consume_mouse_deltas(),
+// also when the totals wrap around
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_mouse.cpp -lpthread
+
+#include "softusb.h"
+#include "test.h"
+
+// Totals of a long running port
+class TestUsb : public SoftUsb
+{
+public:
+	TestUsb() : SoftUsb(0, 0, 1) {}
+	
+	void set_totals(unsigned int total)
+	{
+		_mouse.dx = total;
+		_mouse.dy = total;
+		_mouse.dwheel = total;
+		_mouse_consumed_dx = total;
+		_mouse_consumed_dy = total;
+		_mouse_consumed_dwheel = total;
+	}
+};
+
+// Three reports of X 100, Y -100, wheel 1
+static void move(TestUsb &usb, SoftUsbSimBus *bus, int buttons)
+{
+	unsigned char report[4] = {(unsigned char)buttons, 100, 0x9C, 1};
+	int i;
+	
+	for (i = 0; i < 3; i++)
+	{
+		bus->add_report(1, report, 4);
+	}
+	
+	test_run(usb, 100);
+}
+
+static void check_deltas(TestUsb &usb, int dx, int dy, int dwheel, int buttons)
+{
+	int x, y, w, b;
+	
+	usb.consume_mouse_deltas(x, y, w, b);
+	CHECK(x == dx);
+	CHECK(y == dy);
+	CHECK(w == dwheel);
+	CHECK(b == buttons);
+}
+
+int main()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	TestUsb usb;
+	softusb_mouse_state_t state;
+	int x, y, buttons, wheel;
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_MOUSE) >= 0);
+	
+	move(usb, bus, 1);
+	
+	// Position is limited, totals are not
+	usb.get_mouse_state(state);
+	CHECK(state.x == 300 && state.y == 0 && state.wheel == 3);
+	CHECK(state.dx == 300 && state.dy == (unsigned int)-300 && state.dwheel == 3);
+	usb.get_mouse_pos(x, y, buttons, wheel);
+	CHECK(x == 300 && y == 0 && buttons == 1 && wheel == 3);
+	
+	check_deltas(usb, 300, -300, 3, 1);
+	check_deltas(usb, 0, 0, 0, 1);
+	
+	// Totals pass INT_MAX and UINT_MAX
+	usb.set_totals(0x7FFFFF00);
+	move(usb, bus, 2);
+	check_deltas(usb, 300, -300, 3, 2);
+	
+	usb.set_totals(0xFFFFFF00);
+	move(usb, bus, 0);
+	check_deltas(usb, 300, -300, 3, 0);
+	
+	test_detach(usb, bus);
+	
+	return test_result("test_mouse");
+}
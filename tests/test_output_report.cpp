@@ -0,0 +1,120 @@
+// Keyboard stays connected while its LED output report is sent,
+// the report doesn't delay a due poll, a failed SET_REPORT is given up
+// without losing the device
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_output_report.cpp -lpthread
+
+#include "softusb.h"
+#include "test.h"
+
+class TestUsb : public SoftUsb
+{
+public:
+	TestUsb() : SoftUsb(0, 0, 1) {}
+	
+	// Endpoint was due in the last frame and not polled
+	int is_poll_late()
+	{
+		return _state == su_work && has_due_endpoint();
+	}
+};
+
+static int report_frames = 0;
+static int late_polls = 0;
+
+static void tick(TestUsb &usb)
+{
+	SoftUsbState state;
+	
+	test_run(usb, 1);
+	
+	state = usb.get_state();
+	
+	if (state == su_set_report || state == su_report_data || state == su_report_status)
+	{
+		report_frames++;
+		CHECK(usb.is_connected());
+		CHECK(usb.get_device_type() == USB_DEVICE_KEYBOARD);
+	}
+	
+	if (usb.is_poll_late())
+	{
+		late_polls++;
+	}
+}
+
+// Press and release Caps Lock, wait for the output report
+static void press_caps(TestUsb &usb, SoftUsbSimBus *bus, int frames)
+{
+	unsigned char caps[8] = {0, 0, 0x39, 0, 0, 0, 0, 0};
+	unsigned char none[8] = {0};
+	int i;
+	
+	bus->add_report(1, caps, 8);
+	bus->add_report(1, none, 8);
+	
+	for (i = 0; i < frames; i++)
+	{
+		tick(usb);
+	}
+}
+
+// Keyboard polled every frame, the report follows a poll in the same frame
+static void test_every_frame()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	TestUsb usb;
+	
+	usb.set_poll_interval(1);
+	usb.set_idle_backoff(0, 0);
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_KEYBOARD) >= 0);
+	
+	late_polls = 0;
+	press_caps(usb, bus, 50);
+	
+	CHECK(late_polls == 0);
+	CHECK(bus->get_leds() == KEYBOARD_LOCK_CAPS);
+	CHECK(usb.get_poll_stats()->polls >= 49);
+	
+	test_detach(usb, bus);
+}
+
+int main()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	TestUsb usb;
+	softusb_sim_faults_t faults = {0, 0, 100, 0, 0};
+	softusb_sim_faults_t none = {0, 0, 0, 0, 0};
+	
+	// One stage per frame, report states are seen between calls
+	usb.set_control_budget(SOFTUSB_TRANSACTION_TICKS);
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_KEYBOARD) >= 0);
+	
+	press_caps(usb, bus, 300);
+	
+	CHECK(report_frames > 0);
+	CHECK(bus->get_leds() == KEYBOARD_LOCK_CAPS);
+	
+	// SET_REPORT started in frames between polls
+	CHECK(late_polls == 0);
+	
+	// SETUP of SET_REPORT is never acknowledged, retries take about 500 ms
+	report_frames = 0;
+	bus->set_faults(faults);
+	
+	press_caps(usb, bus, 1000);
+	
+	CHECK(report_frames > 0);
+	CHECK(usb.get_lock_state() == 0);
+	CHECK(bus->get_leds() == KEYBOARD_LOCK_CAPS);
+	CHECK(usb.get_state() == su_work);
+	CHECK(bus->get_stats()->resets == 1);
+	
+	bus->set_faults(none);
+	test_detach(usb, bus);
+	
+	test_every_frame();
+	
+	return test_result("test_output_report");
+}
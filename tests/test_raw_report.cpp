@@ -0,0 +1,100 @@
+// Raw reports of a generic HID device: the slot held by the application
+// is not written, the latest report is published with its sequence number
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_raw_report.cpp -lpthread
+
+#include <string.h>
+#include "softusb.h"
+#include "test.h"
+
+#define REPORT_SIZE		3
+
+static void make_report(unsigned char *report, int n)
+{
+	report[0] = n;
+	report[1] = 0x80 + n;
+	report[2] = 0xFF - n;
+}
+
+static int is_report(const softusb_raw_report_t *r, int n)
+{
+	unsigned char report[REPORT_SIZE];
+	
+	make_report(report, n);
+	
+	return r->length == REPORT_SIZE && memcmp(&r->packet[2], report, REPORT_SIZE) == 0 &&
+		(softusb_crc16(&r->packet[2], REPORT_SIZE + 2) ^ 0xFFFF) == 0xB001;
+}
+
+// Run frames, the held slot must stay as it was
+static void run_holding(SoftUsb &usb, const softusb_raw_report_t *held, int frames)
+{
+	softusb_raw_report_t copy = *held;
+	int i;
+	
+	for (i = 0; i < frames; i++)
+	{
+		test_run(usb, 1);
+		CHECK(memcmp(&copy, held, sizeof(copy)) == 0);
+	}
+}
+
+int main()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	const softusb_raw_report_t *r;
+	unsigned char report[REPORT_SIZE];
+	unsigned int seq;
+	int n, k;
+	
+	usb.set_raw_reports(1);
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_GAMEPAD) >= 0);
+	CHECK(usb.get_device_type() == USB_DEVICE_HID_GENERIC);
+	
+	r = usb.get_raw_report();
+	CHECK(r->length == 0);
+	CHECK(r->seq == 0);
+	seq = 0;
+	
+	// One report between calls
+	for (n = 1; n <= 10; n++)
+	{
+		make_report(report, n);
+		bus->add_report(1, report, REPORT_SIZE);
+		run_holding(usb, r, 30);
+		
+		r = usb.get_raw_report();
+		CHECK(r->seq == seq + 1);
+		CHECK(is_report(r, n));
+		CHECK(r->intf == 0);
+		CHECK(r->ep == 0x81);
+		seq = r->seq;
+	}
+	
+	// Several reports between calls, only the latest one is seen
+	for (k = 0; k < 3; k++)
+	{
+		for (n = 0; n < 4; n++)
+		{
+			make_report(report, 20 + k * 4 + n);
+			bus->add_report(1, report, REPORT_SIZE);
+		}
+		
+		run_holding(usb, r, 60);
+		
+		r = usb.get_raw_report();
+		CHECK(r->seq == seq + 4);
+		CHECK(is_report(r, 20 + k * 4 + 3));
+		seq = r->seq;
+	}
+	
+	// No new reports, the same report is returned
+	run_holding(usb, r, 30);
+	CHECK(usb.get_raw_report()->seq == seq);
+	CHECK(is_report(usb.get_raw_report(), 31));
+	
+	test_detach(usb, bus);
+	
+	return test_result("test_raw_report");
+}
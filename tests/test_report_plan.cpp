@@ -0,0 +1,121 @@
+// Report descriptor plans: report IDs, 16-bit fields, absolute axes
+// and devices without keyboard and mouse fields
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_report_plan.cpp -lpthread
+
+#include "softusb.h"
+#include "test.h"
+
+static void check_field(SoftUsb &usb, int index, int kind, int report_id, int is_signed,
+	int offset, int size, int count, int usage)
+{
+	const softusb_field_t *f = usb.get_report_field(index);
+	
+	CHECK(f != 0);
+	
+	if (f == 0)
+	{
+		return;
+	}
+	
+	CHECK(f->intf == 0);
+	CHECK(f->kind == kind);
+	CHECK(f->report_id == report_id);
+	CHECK(f->is_signed == is_signed);
+	CHECK(f->offset == offset);
+	CHECK(f->size == size);
+	CHECK(f->count == count);
+	CHECK(f->usage == usage);
+}
+
+// Report ID 1, 5 buttons, 16-bit X and Y, 8-bit wheel
+static void test_hires_mouse()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	int dx, dy, dwheel, buttons;
+	unsigned char move[7] = {1, 0x05, 0x2C, 0x01, 0x38, 0xFF, 0x02};
+	unsigned char other[7] = {2, 0x01, 0x10, 0x00, 0x10, 0x00, 0x01};
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_HIRES_MOUSE) >= 0);
+	CHECK(usb.get_device_type() == USB_DEVICE_MOUSE);
+	CHECK(usb.get_report_field_count() == 4);
+	
+	check_field(usb, 0, SOFTUSB_FIELD_BUTTONS, 1, 0, 0, 1, 5, 0x01);
+	check_field(usb, 1, SOFTUSB_FIELD_X, 1, 1, 8, 16, 1, 0x30);
+	check_field(usb, 2, SOFTUSB_FIELD_Y, 1, 1, 24, 16, 1, 0x31);
+	check_field(usb, 3, SOFTUSB_FIELD_WHEEL, 1, 1, 40, 8, 1, 0x38);
+	
+	// X 300, Y -200, wheel 2, then a report with an unknown ID
+	bus->add_report(1, move, 7);
+	bus->add_report(1, other, 7);
+	test_run(usb, 100);
+	
+	usb.consume_mouse_deltas(dx, dy, dwheel, buttons);
+	CHECK(dx == 300);
+	CHECK(dy == -200);
+	CHECK(dwheel == 2);
+	CHECK(buttons == 5);
+	
+	test_detach(usb, bus);
+}
+
+// Absolute X and Y in a mouse collection are not movement
+static void test_tablet()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	int dx, dy, dwheel, buttons;
+	unsigned char report[6] = {0x01, 0x00, 0x40, 0x00, 0x20, 0xFF};
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_TABLET) >= 0);
+	CHECK(usb.get_device_type() == USB_DEVICE_MOUSE);
+	CHECK(usb.get_report_field_count() == 2);
+	
+	check_field(usb, 0, SOFTUSB_FIELD_BUTTONS, 0, 0, 0, 1, 3, 0x01);
+	check_field(usb, 1, SOFTUSB_FIELD_WHEEL, 0, 1, 40, 8, 1, 0x38);
+	
+	bus->add_report(1, report, 6);
+	test_run(usb, 100);
+	
+	usb.consume_mouse_deltas(dx, dy, dwheel, buttons);
+	CHECK(dx == 0);
+	CHECK(dy == 0);
+	CHECK(dwheel == -1);
+	CHECK(buttons == 1);
+	
+	test_detach(usb, bus);
+}
+
+// Gamepad axes are absolute, nothing is decoded
+static void test_gamepad()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	int dx, dy, dwheel, buttons;
+	unsigned char report[3] = {0x81, 0x40, 0xC0};
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_GAMEPAD) >= 0);
+	CHECK(usb.get_device_type() == USB_DEVICE_HID_GENERIC);
+	CHECK(usb.get_interface_type(0) == USB_DEVICE_HID_GENERIC);
+	CHECK(usb.get_report_field_count() == 0);
+	
+	bus->add_report(1, report, 3);
+	test_run(usb, 100);
+	
+	usb.consume_mouse_deltas(dx, dy, dwheel, buttons);
+	CHECK(dx == 0);
+	CHECK(dy == 0);
+	CHECK(buttons == 0);
+	CHECK(!usb.kbhit());
+	
+	test_detach(usb, bus);
+}
+
+int main()
+{
+	test_hires_mouse();
+	test_tablet();
+	test_gamepad();
+	
+	return test_result("test_report_plan");
+}
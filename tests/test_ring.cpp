@@ -0,0 +1,92 @@
+// SoftUsbRing with the producer and the consumer in two threads
+// Build: g++ -O2 -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_ring.cpp -lpthread
+
+#include <thread>
+#include "softusb.h"
+#include "test.h"
+
+#define ITEMS	2000000
+
+// Both words must match, a torn or stale slot is seen as a mismatch
+typedef struct
+{
+	unsigned int seq;
+	unsigned int check;
+} item_t;
+
+static SoftUsbRing<item_t, 16> ring;
+
+static void producer()
+{
+	item_t item;
+	unsigned int seq = 0;
+	
+	while (seq < ITEMS)
+	{
+		item.seq = seq;
+		item.check = ~seq * 2654435761u;
+		
+		if (ring.add(item))
+		{
+			seq++;
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+int main()
+{
+	item_t items[8];
+	unsigned int expected = 0;
+	int i, n, errors = 0, reads = 0;
+	std::thread thread(producer);
+	
+	while (expected < ITEMS)
+	{
+		// Mix single and block reads
+		if (++reads & 1)
+		{
+			n = ring.get(items[0]);
+		}
+		else
+		{
+			n = ring.read(items, 8);
+		}
+		
+		for (i = 0; i < n; i++)
+		{
+			if (items[i].seq != expected || items[i].check != ~expected * 2654435761u)
+			{
+				errors++;
+			}
+			
+			expected++;
+		}
+		
+		if (n == 0)
+		{
+			std::this_thread::yield();
+		}
+	}
+	
+	thread.join();
+	
+	CHECK(errors == 0);
+	CHECK(ring.is_empty());
+	
+	// One more item than the ring holds is dropped
+	for (i = 0; i < 16; i++)
+	{
+		CHECK(ring.add(items[0]));
+	}
+	
+	CHECK(!ring.add(items[0]));
+	CHECK(ring.read(items, 8) == 8);
+	CHECK(ring.read(items, 8) == 8);
+	CHECK(ring.is_empty());
+	
+	return test_result("test_ring");
+}
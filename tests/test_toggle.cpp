@@ -0,0 +1,85 @@
+// Data toggles of the interrupt endpoint: a report sent again after a lost ACK
+// is dropped, unchanged keyboard reports are not decoded
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -I. softusb.cpp softusb_sim.cpp tests/test_toggle.cpp -lpthread
+
+#include "softusb.h"
+#include "test.h"
+
+// Mouse movement is relative, a duplicate would move it twice
+static void test_lost_ack()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	softusb_sim_faults_t lost = {0, 0, 0, 0, 100};
+	softusb_sim_faults_t none = {0, 0, 0, 0, 0};
+	unsigned char move[4] = {0, 5, 0, 0};
+	int dx, dy, dwheel, buttons;
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_MOUSE) >= 0);
+	
+	// Device keeps sending the report with the same DATA PID
+	bus->set_faults(lost);
+	bus->add_report(1, move, 4);
+	test_run(usb, 100);
+	
+	CHECK(bus->get_stats()->retransmits >= 3);
+	CHECK(usb.get_poll_stats()->duplicates == bus->get_stats()->retransmits);
+	
+	usb.consume_mouse_deltas(dx, dy, dwheel, buttons);
+	CHECK(dx == 5);
+	
+	// ACK gets through, toggles are in sync again
+	bus->set_faults(none);
+	test_run(usb, 50);
+	bus->add_report(1, move, 4);
+	bus->add_report(1, move, 4);
+	test_run(usb, 100);
+	
+	// Equal mouse reports are movement
+	usb.consume_mouse_deltas(dx, dy, dwheel, buttons);
+	CHECK(dx == 10);
+	CHECK(usb.get_poll_stats()->unchanged == 0);
+	
+	test_detach(usb, bus);
+}
+
+// Held key is reported again at the idle rate and in equal reports
+static void test_unchanged()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	unsigned char h[8] = {0, 0, 0x0B, 0, 0, 0, 0, 0};
+	unsigned char none[8] = {0};
+	const softusb_poll_stats_t *stats = usb.get_poll_stats();
+	
+	// 100 ms idle rate
+	usb.set_idle_rate(25);
+	
+	CHECK(test_enumerate(usb, bus, SOFTUSB_SIM_KEYBOARD) >= 0);
+	CHECK(bus->get_idle(0) == 25);
+	
+	bus->add_report(1, h, 8);
+	bus->add_report(1, h, 8);
+	bus->add_report(1, h, 8);
+	test_run(usb, 500);
+	
+	CHECK(stats->unchanged >= 2 + 3);
+	CHECK(stats->reports == stats->unchanged + 1);
+	CHECK(stats->duplicates == 0);
+	
+	bus->add_report(1, none, 8);
+	test_run(usb, 50);
+	
+	CHECK(usb.kbhit() && usb.getch() == 'h');
+	CHECK(!usb.kbhit());
+	
+	test_detach(usb, bus);
+}
+
+int main()
+{
+	test_lost_ack();
+	test_unchanged();
+	
+	return test_result("test_toggle");
+}
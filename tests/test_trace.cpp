@@ -0,0 +1,89 @@
+// Transaction trace: durations and pcap export
+// Build: g++ -DSOFTUSB_PLATFORM_HOST -DSOFTUSB_TRACE -I. softusb.cpp softusb_sim.cpp tests/test_trace.cpp -lpthread
+
+#include <string.h>
+#include "softusb.h"
+#include "test.h"
+
+#ifndef SOFTUSB_TRACE
+#error "Build with SOFTUSB_TRACE"
+#endif
+
+static int pcap_bytes = 0;
+
+static void count_bytes(void *context, const void *data, int length)
+{
+	(void)context;
+	(void)data;
+	
+	pcap_bytes += length;
+}
+
+int main()
+{
+	SoftUsbSimBus *bus = softusb_sim_bus(0);
+	SoftUsb usb(0, 0, 1);
+	softusb_trace_t records[16];
+	unsigned char h[8] = {0, 0, 0x0B, 0, 0, 0, 0, 0};
+	int i, j, n, records_total = 0, data_total = 0;
+	int ticks, min_ticks = 0xFFFF, max_ticks = 0;
+	
+	bus->attach_device(SOFTUSB_SIM_KEYBOARD);
+	bus->add_report(1, h, 8);
+	
+	for (i = 1; i <= 1000; i++)
+	{
+		test_run(usb, 1);
+		
+		while ((n = usb.read_trace(records, 16)) > 0)
+		{
+			for (j = 0; j < n; j++)
+			{
+				ticks = records[j].ticks;
+				records_total++;
+				
+				if (records[j].length > 0)
+				{
+					data_total++;
+				}
+				
+				if (ticks < min_ticks)
+				{
+					min_ticks = ticks;
+				}
+				
+				if (ticks > max_ticks)
+				{
+					max_ticks = ticks;
+				}
+			}
+		}
+	}
+	
+	CHECK(usb.get_state() == su_work);
+	CHECK(records_total > 20);
+	CHECK(data_total > 5);
+	
+	// Token and handshake take about 40 bits, a token with 8 data bytes
+	// and handshake about 160 bits. Timer restarts inside the transaction
+	// must not shorten or wrap the duration.
+	CHECK(min_ticks >= 30);
+	CHECK(max_ticks <= SOFTUSB_TRANSACTION_TICKS + 50);
+	
+	// Trace is exported as a pcap file
+	softusb_pcap_header(count_bytes, 0);
+	CHECK(pcap_bytes == 24);
+	
+	memset(records, 0, sizeof(records));
+	records[0].token = 0x69;
+	records[0].data_pid = 0xD2;
+	softusb_pcap_record(&records[0], 1, 1, count_bytes, 0);
+	CHECK(pcap_bytes == 24 + 16 + 48);
+	
+	if (test_failures)
+	{
+		printf("records %d, ticks %d..%d\n", records_total, min_ticks, max_ticks);
+	}
+	
+	return test_result("test_trace");
+}